@@ -0,0 +1,829 @@
+/*============================================================================
+Copyright (c) 2026 Raspberry Pi
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+============================================================================*/
+
+#include <string.h>
+#include <sys/stat.h>
+
+#include "eject.h"
+
+/*----------------------------------------------------------------------------*/
+/* Typedefs and macros                                                        */
+/*----------------------------------------------------------------------------*/
+
+#define DEBUG_ON
+#ifdef DEBUG_ON
+#define DEBUG(fmt,args...) if(getenv("DEBUG_EJ"))g_message("ej: " fmt,##args)
+#else
+#define DEBUG(fmt,args...)
+#endif
+
+#define UDISKS_NAME "org.freedesktop.UDisks2"
+#define UDISKS_BLOCK_PATH "/org/freedesktop/UDisks2/block_devices/"
+
+/* Engine completions are only timed up to when the caller is told the
+ * outcome - the caller's own handler is its to time */
+#define WATCH_COMPLETION(obj) WATCHDOG ("eject", obj); watch_active = &watch
+
+typedef enum {
+    NODE_BLOCK,                     /* Disk or partition */
+    NODE_CRYPT,                     /* dm-crypt mapping */
+    NODE_DM,                        /* Other device-mapper target, normally LVM */
+    NODE_LOOP                       /* Loop device backed by a file on the drive */
+} NodeKind;
+
+typedef struct _StackNode StackNode;
+
+typedef struct {
+    GDrive *drv;
+    EjectVerb verb;
+    int pending;
+    GError *err;
+    gint64 start;
+    gint64 phase;
+    EjectTimes times;
+    EjectDoneFunc done;
+    gpointer user_data;
+    GCancellable *cancel;
+    GDBusConnection *bus;
+    StackNode *stack;
+} EjectOp;
+
+struct _StackNode {
+    char *name;                     /* Kernel name - sdb1, dm-0, loop3 */
+    NodeKind kind;
+    char *mount;                    /* Mount point, if mounted */
+    StackNode *parent;              /* Device this one sits on */
+    GList *holders;                 /* Devices sitting on this one */
+    int pending;
+    gint64 start;
+    EjectOp *op;
+};
+
+/*----------------------------------------------------------------------------*/
+/* Global data                                                                */
+/*----------------------------------------------------------------------------*/
+
+static EjectWatchFunc watch_func;
+static EjectWatch *watch_active;        /* Engine completion being timed, if any */
+
+/*----------------------------------------------------------------------------*/
+/* Prototypes                                                                 */
+/*----------------------------------------------------------------------------*/
+
+static void op_bus_ready (GObject *, GAsyncResult *res, gpointer data);
+static void op_start (EjectOp *op);
+static void op_complete (EjectOp *op, GError *err);
+static void drive_eject_done (GObject *source_object, GAsyncResult *res, gpointer data);
+static void drive_stop_done (GObject *source_object, GAsyncResult *res, gpointer data);
+static void mount_eject_done (GObject *source_object, GAsyncResult *res, gpointer data);
+static void mount_unmount_done (GObject *source_object, GAsyncResult *res, gpointer data);
+static void index_add (GHashTable *index, const char *kind, const char *key, GDrive *drv);
+static char *read_sysfs (const char *fmt, const char *name);
+static GHashTable *read_mountinfo (void);
+static StackNode *node_new (const char *name, StackNode *parent, EjectOp *op, GHashTable *mounts);
+static StackNode *node_find_mount (StackNode *node, const char *path);
+static gboolean node_is_stacked (StackNode *node);
+static void node_free (StackNode *node);
+static StackNode *stack_build (EjectOp *op, const char *disk);
+static void udisks_call (StackNode *node, const char *path, const char *iface, const char *method, GAsyncReadyCallback cb);
+static void node_teardown (StackNode *node);
+static void node_child_done (StackNode *node, GError *err);
+static GMount *find_mount (const char *path);
+static void node_unmount (StackNode *node);
+static void node_mount_done (GObject *source_object, GAsyncResult *res, gpointer data);
+static void node_unmount_done (GObject *source_object, GAsyncResult *res, gpointer data);
+static void node_unmap (StackNode *node);
+static void node_lv_found (GObject *source_object, GAsyncResult *res, gpointer data);
+static void node_unmap_done (GObject *source_object, GAsyncResult *res, gpointer data);
+static void node_finished (StackNode *node, GError *err);
+
+/*----------------------------------------------------------------------------*/
+/* Function definitions                                                       */
+/*----------------------------------------------------------------------------*/
+
+/* Stall watchdog - WATCHDOG is shared by the engine and the plugin, which
+ * sets the function that records stalls; without one nothing is timed */
+
+void eject_set_watch (EjectWatchFunc func)
+{
+    watch_func = func;
+}
+
+gpointer eject_watch_ref (gpointer obj)
+{
+    return watch_func && obj ? g_object_ref (obj) : NULL;
+}
+
+/* Can be called early, in which case leaving the scope does nothing more */
+
+void eject_watch_end (EjectWatch *w)
+{
+    if (w == watch_active) watch_active = NULL;
+    if (!w->name) return;
+
+    if (watch_func) watch_func (w->name, w->event, w->obj, w->start);
+    if (w->obj) g_object_unref (w->obj);
+    w->name = NULL;
+    w->obj = NULL;
+}
+
+static void op_complete (EjectOp *op, GError *err)
+{
+    gint64 now = g_get_monotonic_time ();
+
+    /* keep the first error - later ones are usually knock-on failures */
+    if (err)
+    {
+        if (op->err) g_error_free (err);
+        else op->err = err;
+    }
+    if (--op->pending > 0) return;
+
+    if (op->phase) op->times.eject = now - op->phase;
+    op->times.total = now - op->start;
+    if (watch_active) eject_watch_end (watch_active);
+    op->done (op->drv, op->verb, op->err, &op->times, op->user_data);
+
+    if (op->err) g_error_free (op->err);
+    if (op->stack) node_free (op->stack);
+    if (op->bus) g_object_unref (op->bus);
+    if (op->cancel) g_object_unref (op->cancel);
+    g_object_unref (op->drv);
+    g_free (op);
+}
+
+static void drive_eject_done (GObject *source_object, GAsyncResult *res, gpointer data)
+{
+    WATCH_COMPLETION (source_object);
+    GError *err = NULL;
+    g_drive_eject_with_operation_finish (G_DRIVE (source_object), res, &err);
+    DEBUG ("EJECT %s", err ? "FAILED" : "COMPLETE");
+    op_complete ((EjectOp *) data, err);
+}
+
+static void drive_stop_done (GObject *source_object, GAsyncResult *res, gpointer data)
+{
+    WATCH_COMPLETION (source_object);
+    GError *err = NULL;
+    g_drive_stop_finish (G_DRIVE (source_object), res, &err);
+    DEBUG ("STOP %s", err ? "FAILED" : "COMPLETE");
+    op_complete ((EjectOp *) data, err);
+}
+
+static void mount_eject_done (GObject *source_object, GAsyncResult *res, gpointer data)
+{
+    WATCH_COMPLETION (source_object);
+    GError *err = NULL;
+    g_mount_eject_with_operation_finish (G_MOUNT (source_object), res, &err);
+    DEBUG ("VOL EJECT %s", err ? "FAILED" : "COMPLETE");
+    op_complete ((EjectOp *) data, err);
+}
+
+static void mount_unmount_done (GObject *source_object, GAsyncResult *res, gpointer data)
+{
+    WATCH_COMPLETION (source_object);
+    GError *err = NULL;
+    g_mount_unmount_with_operation_finish (G_MOUNT (source_object), res, &err);
+    DEBUG ("VOL UNMOUNT %s", err ? "FAILED" : "COMPLETE");
+    op_complete ((EjectOp *) data, err);
+}
+
+/* Start ejecting, stopping or unmounting a drive. done may be called before
+ * this returns if there is nothing that can be done with the drive. */
+
+void eject_drive_async (GDrive *drv, EjectVerb verb, GCancellable *cancel, EjectDoneFunc done, gpointer user_data)
+{
+    char *id = g_drive_get_identifier (drv, G_DRIVE_IDENTIFIER_KIND_UNIX_DEVICE);
+    EjectOp *op;
+
+    if (verb == VERB_AUTO)
+    {
+        // this should probably be replaced with a proper less hacky test at some point...
+        if (g_drive_is_media_removable (drv) && id && !strstr (id, "mmcblk0")) verb = VERB_EJECT;
+        else if (g_drive_can_stop (drv)) verb = VERB_STOP;
+    }
+    g_free (id);
+
+    op = g_new0 (EjectOp, 1);
+    op->drv = g_object_ref (drv);
+    op->verb = verb;
+    op->start = g_get_monotonic_time ();
+    op->done = done;
+    op->user_data = user_data;
+    op->cancel = cancel ? g_object_ref (cancel) : NULL;
+
+    /* filesystems on dm-crypt, LVM or loop devices have to be unmounted and
+     * their mappings closed before GIO can do anything with the drive */
+    char *dev = eject_get_devname (drv);
+    if (dev)
+    {
+        op->stack = stack_build (op, dev);
+        g_free (dev);
+    }
+    if (op->stack) g_bus_get (G_BUS_TYPE_SYSTEM, cancel, op_bus_ready, op);
+    else op_start (op);
+}
+
+static void op_bus_ready (GObject *, GAsyncResult *res, gpointer data)
+{
+    WATCH_COMPLETION (((EjectOp *) data)->drv);
+    EjectOp *op = (EjectOp *) data;
+
+    /* without the bus nothing stacked on the drive can be taken down, and
+     * the drive cannot go while it is there - fail rather than skip them */
+    op->bus = g_bus_get_finish (res, &op->err);
+    if (op->bus)
+    {
+        DEBUG ("TEARING DOWN STACKED DEVICES");
+        node_teardown (op->stack);
+    }
+    else op_start (op);
+}
+
+/* Eject, stop or unmount the drive itself once nothing is stacked on it */
+
+static void op_start (EjectOp *op)
+{
+    GCancellable *cancel = op->cancel;
+    GDrive *drv = op->drv;
+    EjectVerb verb = op->verb;
+
+    op->pending = 1;
+    op->phase = g_get_monotonic_time ();
+
+    if (op->err)
+    {
+        /* teardown failed - leave the drive alone */
+    }
+    else if (verb == VERB_EJECT)
+    {
+        DEBUG ("EJECTING DRIVE");
+        op->pending++;
+        g_drive_eject_with_operation (drv, G_MOUNT_UNMOUNT_NONE, NULL, cancel, drive_eject_done, op);
+    }
+    else if (verb == VERB_STOP)
+    {
+        DEBUG ("STOPPING DRIVE");
+        op->pending++;
+        g_drive_stop (drv, G_MOUNT_UNMOUNT_NONE, NULL, cancel, drive_stop_done, op);
+    }
+    else
+    {
+        DEBUG ("EJECTING VOLUMES");
+
+        GList *iter, *mnts = eject_get_mounts (drv);
+        for (iter = mnts; iter != NULL; iter = g_list_next (iter))
+        {
+            GMount *mnt = (GMount *) iter->data;
+            if (verb == VERB_AUTO && g_mount_can_eject (mnt))
+            {
+                DEBUG ("EJECTING VOLUME");
+                op->verb = VERB_EJECT;
+                op->pending++;
+                g_mount_eject_with_operation (mnt, G_MOUNT_UNMOUNT_NONE, NULL, cancel, mount_eject_done, op);
+            }
+            else if (g_mount_can_unmount (mnt))
+            {
+                DEBUG ("UNMOUNTING VOLUME");
+                op->verb = VERB_UNMOUNT;
+                op->pending++;
+                g_mount_unmount_with_operation (mnt, G_MOUNT_UNMOUNT_NONE, NULL, cancel, mount_unmount_done, op);
+            }
+            else
+            {
+                DEBUG ("CANNOT EJECT OR UNMOUNT");
+                continue;
+            }
+
+            /* ejecting one volume ejects the drive; an explicit unmount does them all */
+            if (verb == VERB_AUTO) break;
+        }
+        g_list_free_full (mnts, g_object_unref);
+
+        if (op->pending == 1)
+        {
+            if (op->verb == VERB_AUTO) op->verb = VERB_UNMOUNT;
+
+            /* nothing left is fine if the teardown has already unmounted everything */
+            if (!op->stack)
+                op->err = g_error_new_literal (G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED, "No volume can be ejected or unmounted");
+        }
+    }
+
+    /* drop the reference held while starting operations */
+    op_complete (op, NULL);
+}
+
+GList *eject_get_mounts (GDrive *d)
+{
+    GList *viter, *vols = g_drive_get_volumes (d), *mnts = NULL;
+
+    for (viter = vols; viter != NULL; viter = g_list_next (viter))
+    {
+        GMount *mnt = g_volume_get_mount ((GVolume *) viter->data);
+        if (mnt) mnts = g_list_append (mnts, mnt);
+    }
+    g_list_free_full (vols, g_object_unref);
+    return mnts;
+}
+
+char *eject_get_devname (GDrive *d)
+{
+    char *id = g_drive_get_identifier (d, G_DRIVE_IDENTIFIER_KIND_UNIX_DEVICE);
+    char *dev = NULL;
+
+    if (id && g_str_has_prefix (id, "/dev/")) dev = g_strdup (id + 5);
+    g_free (id);
+    return dev;
+}
+
+/* Directory sysfs is read from - normally the real root, but setting
+ * EJECTER_SYSFS_ROOT points it at a fake tree for testing */
+
+const char *eject_sysfs_root (void)
+{
+    static const char *root;
+
+    if (!root) root = g_getenv ("EJECTER_SYSFS_ROOT") ? g_getenv ("EJECTER_SYSFS_ROOT") : "";
+    return root;
+}
+
+char *eject_get_mount_path (GMount *mnt)
+{
+    GFile *root = g_mount_get_root (mnt);
+    char *path = g_file_get_path (root);
+    if (!path) path = g_file_get_uri (root);
+    g_object_unref (root);
+    return path;
+}
+
+/* Stacked device teardown */
+
+static char *read_sysfs (const char *fmt, const char *name)
+{
+    char *rel = g_strdup_printf (fmt, name), *path, *val = NULL;
+
+    path = g_strconcat (eject_sysfs_root (), rel, NULL);
+    if (g_file_get_contents (path, &val, NULL, NULL)) g_strchomp (val);
+    g_free (path);
+    g_free (rel);
+    return val;
+}
+
+/* Map each mounted device number to its mount point */
+
+static GHashTable *read_mountinfo (void)
+{
+    GHashTable *mounts = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+    char *buf, **lines, **line;
+
+    if (!g_file_get_contents ("/proc/self/mountinfo", &buf, NULL, NULL)) return mounts;
+
+    /* fields are id, parent id, major:minor, root, mount point, ... */
+    lines = g_strsplit (buf, "\n", -1);
+    for (line = lines; *line; line++)
+    {
+        char **fields = g_strsplit (*line, " ", 6);
+        if (g_strv_length (fields) >= 5 && !g_hash_table_contains (mounts, fields[2]))
+            g_hash_table_insert (mounts, g_strdup (fields[2]), g_strcompress (fields[4]));
+        g_strfreev (fields);
+    }
+    g_strfreev (lines);
+    g_free (buf);
+    return mounts;
+}
+
+static StackNode *node_new (const char *name, StackNode *parent, EjectOp *op, GHashTable *mounts)
+{
+    StackNode *node = g_new0 (StackNode, 1);
+    const char *holder;
+    char *str, *path;
+    GDir *dir;
+
+    node->name = g_strdup (name);
+    node->parent = parent;
+    node->op = op;
+    node->kind = NODE_BLOCK;
+
+    if (g_str_has_prefix (name, "loop")) node->kind = NODE_LOOP;
+    else if (g_str_has_prefix (name, "dm-"))
+    {
+        str = read_sysfs ("/sys/class/block/%s/dm/uuid", name);
+        node->kind = str && g_str_has_prefix (str, "CRYPT-") ? NODE_CRYPT : NODE_DM;
+        g_free (str);
+    }
+
+    str = read_sysfs ("/sys/class/block/%s/dev", name);
+    if (str) node->mount = g_strdup (g_hash_table_lookup (mounts, str));
+    g_free (str);
+
+    path = g_strdup_printf ("%s/sys/class/block/%s/holders", eject_sysfs_root (), name);
+    dir = g_dir_open (path, 0, NULL);
+    if (dir)
+    {
+        while ((holder = g_dir_read_name (dir)))
+            node->holders = g_list_append (node->holders, node_new (holder, node, op, mounts));
+        g_dir_close (dir);
+    }
+    g_free (path);
+    return node;
+}
+
+static StackNode *node_find_mount (StackNode *node, const char *path)
+{
+    StackNode *res = NULL;
+    GList *l;
+
+    if (node->mount && g_str_has_prefix (path, node->mount) && path[strlen (node->mount)] == '/') return node;
+    for (l = node->holders; l != NULL && !res; l = l->next)
+        res = node_find_mount ((StackNode *) l->data, path);
+    return res;
+}
+
+static gboolean node_is_stacked (StackNode *node)
+{
+    GList *l;
+
+    if (node->kind != NODE_BLOCK) return TRUE;
+    for (l = node->holders; l != NULL; l = l->next)
+        if (node_is_stacked ((StackNode *) l->data)) return TRUE;
+    return FALSE;
+}
+
+static void node_free (StackNode *node)
+{
+    g_list_free_full (node->holders, (GDestroyNotify) node_free);
+    g_free (node->mount);
+    g_free (node->name);
+    g_free (node);
+}
+
+/* Build the tree of block devices on a drive from sysfs - partitions, their
+ * holders, and loop devices backed by files on any of them. Returns NULL if
+ * the drive only has plain partitions, which GIO can handle on its own. */
+
+static StackNode *stack_build (EjectOp *op, const char *disk)
+{
+    GHashTable *mounts = read_mountinfo ();
+    StackNode *root, *node;
+    const char *name;
+    char *path, *str;
+    GDir *dir;
+
+    root = node_new (disk, NULL, op, mounts);
+
+    path = g_strdup_printf ("%s/sys/block/%s", eject_sysfs_root (), disk);
+    dir = g_dir_open (path, 0, NULL);
+    if (dir)
+    {
+        while ((name = g_dir_read_name (dir)))
+        {
+            if (!g_str_has_prefix (name, disk)) continue;
+            str = g_strdup_printf ("%s/%s/partition", path, name);
+            if (g_file_test (str, G_FILE_TEST_EXISTS))
+                root->holders = g_list_append (root->holders, node_new (name, root, op, mounts));
+            g_free (str);
+        }
+        g_dir_close (dir);
+    }
+    g_free (path);
+
+    path = g_strconcat (eject_sysfs_root (), "/sys/block", NULL);
+    dir = g_dir_open (path, 0, NULL);
+    g_free (path);
+    if (dir)
+    {
+        while ((name = g_dir_read_name (dir)))
+        {
+            if (!g_str_has_prefix (name, "loop")) continue;
+            str = read_sysfs ("/sys/block/%s/loop/backing_file", name);
+            if (str && (node = node_find_mount (root, str)))
+                node->holders = g_list_append (node->holders, node_new (name, node, op, mounts));
+            g_free (str);
+        }
+        g_dir_close (dir);
+    }
+
+    g_hash_table_unref (mounts);
+    if (!node_is_stacked (root))
+    {
+        node_free (root);
+        return NULL;
+    }
+    return root;
+}
+
+char *eject_udisks_path (const char *name)
+{
+    GString *path = g_string_new (UDISKS_BLOCK_PATH);
+    const char *c;
+
+    /* UDisks escapes anything other than alphanumerics and underscores as _xx */
+    for (c = name; *c; c++)
+    {
+        if (g_ascii_isalnum (*c) || *c == '_') g_string_append_c (path, *c);
+        else g_string_append_printf (path, "_%02x", (unsigned char) *c);
+    }
+    return g_string_free (path, FALSE);
+}
+
+static void udisks_call (StackNode *node, const char *path, const char *iface, const char *method, GAsyncReadyCallback cb)
+{
+    DEBUG ("%s.%s %s", iface, method, path);
+    node->start = g_get_monotonic_time ();
+
+    /* unmounting flushes the filesystem, which can take a very long time */
+    g_dbus_connection_call (node->op->bus, UDISKS_NAME, path, iface, method, g_variant_new ("(a{sv})", NULL),
+        NULL, G_DBUS_CALL_FLAGS_NONE, G_MAXINT, node->op->cancel, cb, node);
+}
+
+/* Tear down everything sitting on a node in parallel, then the node itself */
+
+static void node_teardown (StackNode *node)
+{
+    GList *l;
+
+    node->pending = g_list_length (node->holders) + 1;
+    for (l = node->holders; l != NULL; l = l->next)
+        node_teardown ((StackNode *) l->data);
+    node_child_done (node, NULL);
+}
+
+static void node_child_done (StackNode *node, GError *err)
+{
+    if (err)
+    {
+        if (node->op->err) g_error_free (err);
+        else node->op->err = err;
+    }
+    if (--node->pending > 0) return;
+
+    if (node->op->err) node_finished (node, NULL);
+    else node_unmount (node);
+}
+
+/* The GIO mount for a mount point, if the volume monitor knows about it */
+
+static GMount *find_mount (const char *path)
+{
+    GVolumeMonitor *monitor = g_volume_monitor_get ();
+    GList *iter, *mnts = g_volume_monitor_get_mounts (monitor);
+    GMount *res = NULL;
+    char *str;
+
+    for (iter = mnts; iter != NULL && !res; iter = g_list_next (iter))
+    {
+        str = eject_get_mount_path ((GMount *) iter->data);
+        if (!g_strcmp0 (str, path)) res = g_object_ref ((GMount *) iter->data);
+        g_free (str);
+    }
+    g_list_free_full (mnts, g_object_unref);
+    g_object_unref (monitor);
+    return res;
+}
+
+static void node_unmount (StackNode *node)
+{
+    GMount *mnt;
+    char *path;
+
+    if (!node->mount)
+    {
+        node_unmap (node);
+        return;
+    }
+
+    /* unmount through GIO where possible, so that anything watching the
+     * mount - the panel plugin included - sees mount-pre-unmount first */
+    mnt = find_mount (node->mount);
+    if (mnt)
+    {
+        DEBUG ("UNMOUNTING %s", node->mount);
+        node->start = g_get_monotonic_time ();
+        g_mount_unmount_with_operation (mnt, G_MOUNT_UNMOUNT_NONE, NULL, node->op->cancel, node_mount_done, node);
+        g_object_unref (mnt);
+        return;
+    }
+
+    path = eject_udisks_path (node->name);
+    udisks_call (node, path, UDISKS_NAME ".Filesystem", "Unmount", node_unmount_done);
+    g_free (path);
+}
+
+static void node_mount_done (GObject *source_object, GAsyncResult *res, gpointer data)
+{
+    WATCH_COMPLETION (((StackNode *) data)->op->drv);
+    StackNode *node = (StackNode *) data;
+    GError *err = NULL;
+
+    g_mount_unmount_with_operation_finish (G_MOUNT (source_object), res, &err);
+    node->op->times.unmount += g_get_monotonic_time () - node->start;
+
+    if (err) node_finished (node, err);
+    else node_unmap (node);
+}
+
+static void node_unmount_done (GObject *source_object, GAsyncResult *res, gpointer data)
+{
+    WATCH_COMPLETION (((StackNode *) data)->op->drv);
+    StackNode *node = (StackNode *) data;
+    GError *err = NULL;
+    GVariant *ret;
+
+    ret = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source_object), res, &err);
+    node->op->times.unmount += g_get_monotonic_time () - node->start;
+    if (ret) g_variant_unref (ret);
+
+    if (err) node_finished (node, err);
+    else node_unmap (node);
+}
+
+static void node_unmap (StackNode *node)
+{
+    char *path;
+
+    switch (node->kind)
+    {
+        case NODE_LOOP :
+            path = eject_udisks_path (node->name);
+            udisks_call (node, path, UDISKS_NAME ".Loop", "Delete", node_unmap_done);
+            g_free (path);
+            break;
+
+        case NODE_CRYPT :
+            /* a LUKS mapping is closed through the device it was opened from */
+            path = eject_udisks_path (node->parent->name);
+            udisks_call (node, path, UDISKS_NAME ".Encrypted", "Lock", node_unmap_done);
+            g_free (path);
+            break;
+
+        case NODE_DM :
+            path = eject_udisks_path (node->name);
+            node->start = g_get_monotonic_time ();
+            g_dbus_connection_call (node->op->bus, UDISKS_NAME, path, "org.freedesktop.DBus.Properties", "Get",
+                g_variant_new ("(ss)", UDISKS_NAME ".Block", "LogicalVolume"), G_VARIANT_TYPE ("(v)"),
+                G_DBUS_CALL_FLAGS_NONE, -1, node->op->cancel, node_lv_found, node);
+            g_free (path);
+            break;
+
+        default :
+            node_finished (node, NULL);
+            break;
+    }
+}
+
+static void node_lv_found (GObject *source_object, GAsyncResult *res, gpointer data)
+{
+    WATCH_COMPLETION (((StackNode *) data)->op->drv);
+    StackNode *node = (StackNode *) data;
+    GVariant *ret, *val;
+    GError *err = NULL;
+
+    ret = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source_object), res, &err);
+    if (!ret)
+    {
+        node_finished (node, err);
+        return;
+    }
+
+    g_variant_get (ret, "(v)", &val);
+    const char *lv = g_variant_get_string (val, NULL);
+    if (g_strcmp0 (lv, "/"))
+        udisks_call (node, lv, UDISKS_NAME ".LogicalVolume", "Deactivate", node_unmap_done);
+    else
+        node_finished (node, g_error_new (G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED, "Don't know how to close %s", node->name));
+    g_variant_unref (val);
+    g_variant_unref (ret);
+}
+
+static void node_unmap_done (GObject *source_object, GAsyncResult *res, gpointer data)
+{
+    WATCH_COMPLETION (((StackNode *) data)->op->drv);
+    StackNode *node = (StackNode *) data;
+    GError *err = NULL;
+    GVariant *ret;
+
+    ret = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source_object), res, &err);
+    node->op->times.unmap += g_get_monotonic_time () - node->start;
+    if (ret) g_variant_unref (ret);
+
+    node_finished (node, err);
+}
+
+static void node_finished (StackNode *node, GError *err)
+{
+    DEBUG ("TEARDOWN %s %s", node->name, err ? err->message : "COMPLETE");
+    if (node->parent) node_child_done (node->parent, err);
+    else
+    {
+        if (err)
+        {
+            if (node->op->err) g_error_free (err);
+            else node->op->err = err;
+        }
+        op_start (node->op);
+    }
+}
+
+/* Drive index */
+
+static void index_add (GHashTable *index, const char *kind, const char *key, GDrive *drv)
+{
+    if (!key || !*key) return;
+    g_hash_table_insert (index, g_strdup_printf ("%s:%s", kind, key), g_object_ref (drv));
+}
+
+/* Build a table mapping each drive's device, its partitions' devices, labels
+ * and UUIDs, and its mount points to the drive itself */
+
+GHashTable *eject_index_new (GList *drives)
+{
+    GHashTable *index = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_object_unref);
+    GList *driter, *viter, *vols;
+    char *str;
+
+    for (driter = drives; driter != NULL; driter = g_list_next (driter))
+    {
+        GDrive *drv = (GDrive *) driter->data;
+        str = g_drive_get_identifier (drv, G_DRIVE_IDENTIFIER_KIND_UNIX_DEVICE);
+        index_add (index, "dev", str, drv);
+        g_free (str);
+
+        vols = g_drive_get_volumes (drv);
+        for (viter = vols; viter != NULL; viter = g_list_next (viter))
+        {
+            GVolume *v = (GVolume *) viter->data;
+            str = g_volume_get_identifier (v, G_VOLUME_IDENTIFIER_KIND_UNIX_DEVICE);
+            index_add (index, "dev", str, drv);
+            g_free (str);
+            str = g_volume_get_identifier (v, G_VOLUME_IDENTIFIER_KIND_LABEL);
+            index_add (index, "label", str, drv);
+            g_free (str);
+            str = g_volume_get_identifier (v, G_VOLUME_IDENTIFIER_KIND_UUID);
+            index_add (index, "uuid", str, drv);
+            g_free (str);
+
+            GMount *mnt = g_volume_get_mount (v);
+            if (mnt)
+            {
+                str = eject_get_mount_path (mnt);
+                index_add (index, "mount", str, drv);
+                g_free (str);
+                g_object_unref (mnt);
+            }
+        }
+        g_list_free_full (vols, g_object_unref);
+    }
+    return index;
+}
+
+/* Look up a drive by /dev path, label=<label>, uuid=<uuid> or mount point */
+
+GDrive *eject_index_lookup (GHashTable *index, const char *spec)
+{
+    GDrive *drv;
+    char *key;
+
+    if (g_str_has_prefix (spec, "label=")) key = g_strdup_printf ("label:%s", spec + 6);
+    else if (g_str_has_prefix (spec, "uuid=")) key = g_strdup_printf ("uuid:%s", spec + 5);
+    else if (g_str_has_prefix (spec, "/dev/")) key = g_strdup_printf ("dev:%s", spec);
+    else if (spec[0] == '/')
+    {
+        /* mount points are indexed without a trailing separator */
+        key = g_strdup_printf ("mount:%s", spec);
+        int len = strlen (key);
+        if (len > 7 && key[len - 1] == '/') key[len - 1] = 0;
+    }
+    else return NULL;
+
+    drv = g_hash_table_lookup (index, key);
+    g_free (key);
+    return drv;
+}
+
+/* End of file */
+/*----------------------------------------------------------------------------*/
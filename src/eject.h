@@ -0,0 +1,93 @@
+/*============================================================================
+Copyright (c) 2026 Raspberry Pi
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+============================================================================*/
+
+#ifndef EJECT_H
+#define EJECT_H
+
+#include <gio/gio.h>
+
+/*----------------------------------------------------------------------------*/
+/* Typedefs and macros                                                        */
+/*----------------------------------------------------------------------------*/
+
+typedef enum {
+    VERB_MARK,                      /* Record an eject done elsewhere - plugin only */
+    VERB_AUTO,                      /* Eject, stop or unmount as the drive allows */
+    VERB_EJECT,
+    VERB_STOP,
+    VERB_UNMOUNT
+} EjectVerb;
+
+/* Time spent in each layer of the teardown, in microseconds. Mappings on
+ * separate partitions are torn down in parallel, so the layers can add up
+ * to more than the total. */
+typedef struct {
+    gint64 total;                   /* Whole operation */
+    gint64 unmount;                 /* Unmounting filesystems on mapped devices */
+    gint64 unmap;                   /* Closing dm-crypt, LVM and loop mappings */
+    gint64 eject;                   /* Final eject, stop or unmount of the drive */
+} EjectTimes;
+
+/* Called once per drive when every operation on it has finished. verb is the
+ * operation actually used; err is NULL on success and owned by the engine. */
+typedef void (*EjectDoneFunc) (GDrive *drv, EjectVerb verb, GError *err, const EjectTimes *times, gpointer user_data);
+
+/* Called as each watched handler or completion ends, with the drive, volume
+ * or mount it was for and when it started - see eject_set_watch */
+typedef void (*EjectWatchFunc) (const char *name, const char *event, gpointer obj, gint64 start);
+
+/* WATCHDOG at the top of a handler or completion times it until it returns.
+ * The object is held until then, as completions often free what they ran for. */
+typedef struct {
+    const char *name;
+    const char *event;
+    gpointer obj;
+    gint64 start;
+} EjectWatch;
+
+#define WATCHDOG(event,obj) EjectWatch watch __attribute__ ((cleanup (eject_watch_end), unused)) = { __func__, event, eject_watch_ref (obj), g_get_monotonic_time () }
+
+/*----------------------------------------------------------------------------*/
+/* Prototypes                                                                 */
+/*----------------------------------------------------------------------------*/
+
+extern void eject_set_watch (EjectWatchFunc func);
+extern gpointer eject_watch_ref (gpointer obj);
+extern void eject_watch_end (EjectWatch *w);
+extern void eject_drive_async (GDrive *drv, EjectVerb verb, GCancellable *cancel, EjectDoneFunc done, gpointer user_data);
+extern GList *eject_get_mounts (GDrive *d);
+extern char *eject_get_devname (GDrive *d);
+extern char *eject_get_mount_path (GMount *mnt);
+extern char *eject_udisks_path (const char *name);
+extern const char *eject_sysfs_root (void);
+extern GHashTable *eject_index_new (GList *drives);
+extern GDrive *eject_index_lookup (GHashTable *index, const char *spec);
+
+#endif
+
+/* End of file */
+/*----------------------------------------------------------------------------*/
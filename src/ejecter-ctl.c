@@ -0,0 +1,299 @@
+/*============================================================================
+Copyright (c) 2026 Raspberry Pi
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+============================================================================*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "eject.h"
+
+/*----------------------------------------------------------------------------*/
+/* Typedefs and macros                                                        */
+/*----------------------------------------------------------------------------*/
+
+typedef struct {
+    char *spec;
+    GDrive *drv;
+    char *name;
+    char *error;
+    EjectVerb verb;
+    EjectTimes times;
+} Target;
+
+/*----------------------------------------------------------------------------*/
+/* Global data                                                                */
+/*----------------------------------------------------------------------------*/
+
+static gboolean all, stop, unmount, json;
+static int timeout;
+static char **specs;
+
+static GOptionEntry entries[] = {
+    { "all", 'a', 0, G_OPTION_ARG_NONE, &all, "Eject every mounted removable drive", NULL },
+    { "stop", 's', 0, G_OPTION_ARG_NONE, &stop, "Stop drives rather than ejecting them", NULL },
+    { "unmount", 'u', 0, G_OPTION_ARG_NONE, &unmount, "Only unmount the volumes on each drive", NULL },
+    { "json", 'j', 0, G_OPTION_ARG_NONE, &json, "Write results as JSON", NULL },
+    { "timeout", 't', 0, G_OPTION_ARG_INT, &timeout, "Give up after this many seconds", "SECS" },
+    { G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &specs, NULL, "DRIVE..." },
+    { NULL }
+};
+
+static GMainLoop *loop;
+static int pending;
+
+/*----------------------------------------------------------------------------*/
+/* Prototypes                                                                 */
+/*----------------------------------------------------------------------------*/
+
+static Target *add_target (GPtrArray *targets, const char *spec, GDrive *drv);
+static void free_target (gpointer data);
+static void target_done (GDrive *drv, EjectVerb verb, GError *err, const EjectTimes *times, gpointer data);
+static gboolean timed_out (gpointer data);
+static const char *verb_name (EjectVerb verb);
+static void json_string (GString *str, const char *val);
+static void print_results (GPtrArray *targets);
+
+/*----------------------------------------------------------------------------*/
+/* Function definitions                                                       */
+/*----------------------------------------------------------------------------*/
+
+static Target *add_target (GPtrArray *targets, const char *spec, GDrive *drv)
+{
+    Target *t = g_new0 (Target, 1);
+    t->spec = g_strdup (spec);
+    t->drv = drv ? g_object_ref (drv) : NULL;
+    t->name = drv ? g_drive_get_name (drv) : NULL;
+    t->verb = VERB_AUTO;
+    g_ptr_array_add (targets, t);
+    return t;
+}
+
+static void free_target (gpointer data)
+{
+    Target *t = (Target *) data;
+    if (t->drv) g_object_unref (t->drv);
+    g_free (t->spec);
+    g_free (t->name);
+    g_free (t->error);
+    g_free (t);
+}
+
+static void target_done (GDrive *, EjectVerb verb, GError *err, const EjectTimes *times, gpointer data)
+{
+    Target *t = (Target *) data;
+
+    t->verb = verb;
+    t->times = *times;
+    if (err) t->error = g_strdup (err->message);
+
+    if (--pending == 0 && loop) g_main_loop_quit (loop);
+}
+
+static gboolean timed_out (gpointer data)
+{
+    /* cancelled operations still complete through target_done */
+    g_cancellable_cancel (G_CANCELLABLE (data));
+    return FALSE;
+}
+
+static const char *verb_name (EjectVerb verb)
+{
+    switch (verb)
+    {
+        case VERB_STOP :    return "stop";
+        case VERB_UNMOUNT : return "unmount";
+        default :           return "eject";
+    }
+}
+
+static void json_string (GString *str, const char *val)
+{
+    const char *c;
+
+    if (!val)
+    {
+        g_string_append (str, "null");
+        return;
+    }
+
+    g_string_append_c (str, '"');
+    for (c = val; *c; c++)
+    {
+        if (*c == '"' || *c == '\\') g_string_append_printf (str, "\\%c", *c);
+        else if ((unsigned char) *c < 0x20) g_string_append_printf (str, "\\u%04x", *c);
+        else g_string_append_c (str, *c);
+    }
+    g_string_append_c (str, '"');
+}
+
+static void print_results (GPtrArray *targets)
+{
+    GString *str = g_string_new (NULL);
+    guint i;
+
+    if (json) g_string_append (str, "[\n");
+    for (i = 0; i < targets->len; i++)
+    {
+        Target *t = (Target *) g_ptr_array_index (targets, i);
+        const char *status = !t->drv ? "not found" : t->error ? "failed" : "ok";
+
+        if (json)
+        {
+            g_string_append (str, "  { \"drive\": ");
+            json_string (str, t->spec);
+            g_string_append (str, ", \"name\": ");
+            json_string (str, t->name);
+            g_string_append (str, ", \"action\": ");
+            json_string (str, verb_name (t->verb));
+            g_string_append (str, ", \"status\": ");
+            json_string (str, status);
+            g_string_append_printf (str, ", \"seconds\": %.3f, \"unmount\": %.3f, \"unmap\": %.3f, \"eject\": %.3f, \"error\": ",
+                t->times.total / 1000000.0, t->times.unmount / 1000000.0, t->times.unmap / 1000000.0, t->times.eject / 1000000.0);
+            json_string (str, t->error);
+            g_string_append_printf (str, " }%s\n", i + 1 < targets->len ? "," : "");
+        }
+        else
+        {
+            g_string_append_printf (str, "%s\t%s\t%s\t%.3fs", t->spec, verb_name (t->verb), status, t->times.total / 1000000.0);
+            if (t->name) g_string_append_printf (str, "\t%s", t->name);
+            if (t->error) g_string_append_printf (str, "\t%s", t->error);
+            g_string_append_c (str, '\n');
+        }
+    }
+    if (json) g_string_append (str, "]\n");
+
+    fputs (str->str, stdout);
+    g_string_free (str, TRUE);
+}
+
+int main (int argc, char *argv[])
+{
+    GOptionContext *ctx;
+    GVolumeMonitor *monitor;
+    GCancellable *cancel;
+    GHashTable *index;
+    GPtrArray *targets;
+    GList *drives, *l;
+    GError *err = NULL;
+    EjectVerb verb;
+    int i, res = 0;
+    guint j;
+
+    ctx = g_option_context_new ("- safely eject removable drives");
+    g_option_context_set_description (ctx, "Each DRIVE is a /dev path, label=<label>, uuid=<uuid> or a mount point.\n"
+        "Exit status is 0 if every drive was ejected, 1 if any failed and 2 on error.");
+    g_option_context_add_main_entries (ctx, entries, NULL);
+    if (!g_option_context_parse (ctx, &argc, &argv, &err))
+    {
+        g_printerr ("%s\n", err->message);
+        g_error_free (err);
+        g_option_context_free (ctx);
+        return 2;
+    }
+    g_option_context_free (ctx);
+
+    if (!all && !specs)
+    {
+        g_printerr ("No drives specified - use --all to eject every removable drive\n");
+        return 2;
+    }
+    verb = stop ? VERB_STOP : unmount ? VERB_UNMOUNT : VERB_AUTO;
+
+    monitor = g_volume_monitor_get ();
+    drives = g_volume_monitor_get_connected_drives (monitor);
+    index = eject_index_new (drives);
+    targets = g_ptr_array_new_with_free_func (free_target);
+
+    for (i = 0; specs && specs[i]; i++)
+        add_target (targets, specs[i], eject_index_lookup (index, specs[i]));
+
+    if (all)
+    {
+        for (l = drives; l != NULL; l = l->next)
+        {
+            GDrive *drv = (GDrive *) l->data;
+            GList *mnts = eject_get_mounts (drv);
+            if (g_drive_is_removable (drv) && mnts)
+            {
+                char *id = g_drive_get_identifier (drv, G_DRIVE_IDENTIFIER_KIND_UNIX_DEVICE);
+                add_target (targets, id ? id : "-", drv);
+                g_free (id);
+            }
+            g_list_free_full (mnts, g_object_unref);
+        }
+    }
+
+    /* a drive named more than once is only ejected once */
+    for (j = 0; j < targets->len; j++)
+    {
+        Target *t = (Target *) g_ptr_array_index (targets, j);
+        guint k;
+        for (k = 0; k < j && t->drv; k++)
+        {
+            if (((Target *) g_ptr_array_index (targets, k))->drv == t->drv)
+            {
+                g_ptr_array_remove_index (targets, j--);
+                break;
+            }
+        }
+    }
+
+    /* start everything at once, so each drive flushes in parallel */
+    cancel = g_cancellable_new ();
+    loop = NULL;
+    for (j = 0; j < targets->len; j++)
+        if (((Target *) g_ptr_array_index (targets, j))->drv) pending++;
+    for (j = 0; j < targets->len; j++)
+    {
+        Target *t = (Target *) g_ptr_array_index (targets, j);
+        if (t->drv) eject_drive_async (t->drv, verb, cancel, target_done, t);
+    }
+
+    if (pending)
+    {
+        loop = g_main_loop_new (NULL, FALSE);
+        if (timeout > 0) g_timeout_add_seconds (timeout, timed_out, cancel);
+        g_main_loop_run (loop);
+        g_main_loop_unref (loop);
+    }
+
+    print_results (targets);
+    for (j = 0; j < targets->len; j++)
+    {
+        Target *t = (Target *) g_ptr_array_index (targets, j);
+        if (!t->drv || t->error) res = 1;
+    }
+
+    g_object_unref (cancel);
+    g_ptr_array_unref (targets);
+    g_hash_table_unref (index);
+    g_list_free_full (drives, g_object_unref);
+    g_object_unref (monitor);
+    return res;
+}
+
+/* End of file */
+/*----------------------------------------------------------------------------*/
@@ -26,7 +26,16 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 ============================================================================*/
 
 #include <locale.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <dirent.h>
 #include <glib/gi18n.h>
+#include <gio/gunixfdlist.h>
 
 #ifdef LXPLUG
 #include "plugin.h"
@@ -35,6 +44,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #endif
 
 #include "ejecter.h"
+#include "eject.h"
 
 /*----------------------------------------------------------------------------*/
 /* Typedefs and macros                                                        */
@@ -49,23 +59,271 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #define HIDE_TIME_MS 5000
 
+#define IO_SAMPLE_MS 1000
+#define IO_RING_LEN 4
+#define SECTOR_SIZE 512
+
+#define FS_CACHE_TTL_US (30 * G_USEC_PER_SEC)
+
+#define MENU_GROUP_MIN 8
+
+#define ACT_MIN_MS 250
+#define ACT_MAX_MS 4000
+
+#define STALL_RING 32
+#define STALL_DEFAULT_MS 50
+
+#define MEM_HEADER 16
+#define mem_new0(type,tag) ((type *) mem_alloc (tag, sizeof (type)))
+
+#define BDI_DEFAULT_RATE (4 * 1024 * 1024)
+#define BDI_ATTRS 3
+
+#define PREFETCH_DEPTH 2
+#define PREFETCH_ENTRIES 4096
+#define PREFETCH_MS 5000
+
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+
+#define JOURNAL_FILE "ejecter.journal"
+#define JOURNAL_VERSION 1
+#define JOURNAL_SLOTS 512
+#define JOURNAL_COMPACT_AT (JOURNAL_SLOTS * 3 / 4)
+#define JOURNAL_KEEP (JOURNAL_SLOTS / 4)
+
+#define LOGIND_NAME "org.freedesktop.login1"
+#define LOGIND_PATH "/org/freedesktop/login1"
+#define LOGIND_IFACE "org.freedesktop.login1.Manager"
+
+#define UDISKS_NAME "org.freedesktop.UDisks2"
+#define PROFILES_FILE "profiles.ini"
+
+#define FILEMANAGER_NAME "org.freedesktop.FileManager1"
+#define FILEMANAGER_PATH "/org/freedesktop/FileManager1"
+#define FLUSH_DEADLINE_MS 4000
+
 typedef struct {
     EjecterPlugin *ej;
     GDrive *drv;
 } CallbackData;
 
+typedef struct {
+    gint64 when;
+    gint64 duration;
+    const char *name;
+    const char *event;
+    char dev[32];
+} Stall;
+
+typedef enum {
+    MEM_TRACKING,
+    MEM_MENU,
+    MEM_NOTIFY,
+    MEM_ASYNC,
+    MEM_TAGS
+} MemTag;
+
+typedef struct {
+    gsize live;
+    gsize peak;
+    guint allocs;
+    guint frees;
+} MemCount;
+
+typedef struct {
+    EjecterPlugin *ej;
+    GCancellable *cancel;
+    GDrive *drv;                    /* Held until the eject starts */
+    EjectVerb verb;
+} AsyncCall;
+
 typedef struct {
     GDrive *drv;
     int seq;
 } EjectList;
 
+typedef struct {
+    guint ejects;
+    guint failures;
+    EjectTimes last;
+    gint64 max_total;
+    gint64 flush;                   /* Time to flush before the last suspend or shutdown */
+    char profile[32];               /* Mount profile used when last automounted */
+} DevStats;
+
+typedef struct {
+    char *dir;                      /* The drive's bdi directory in sysfs */
+    char *saved[BDI_ATTRS];         /* Values before limiting - NULL where the kernel lacks the attribute */
+    guint64 rate;                   /* Fastest write rate seen, in bytes per second */
+} BdiLimit;
+
+typedef struct {
+    EjecterPlugin *ej;
+    GCancellable *cancel;
+    GVolume *vol;
+    char *profile;                  /* Name of the mount profile used, if any */
+    char *opts;                     /* Its mount options, until UDisks has been asked */
+    char *dev;
+    gboolean notify;
+} MountCall;
+
+typedef enum {
+    JS_NONE,
+    JS_MOUNTED,
+    JS_EJECTED,
+    JS_REMOVED
+} JournalState;
+
+/* Fixed-size so a torn write can only ever damage the last record */
+typedef struct {
+    guint32 crc;                    /* Checksum of the rest of the record - 0 marks an unused slot */
+    guint32 seq;
+    guint32 state;
+    guint32 ejects;
+    guint32 failures;
+    guint32 pad;
+    gint64 last_total;
+    char id[96];                    /* Stable device ID */
+} JournalRecord;
+
+typedef struct _Journal {
+    char *path;
+    JournalRecord *map;             /* Shared mapping of the journal file */
+    guint pos;                      /* Next free slot */
+    guint32 seq;
+    GHashTable *state;              /* Latest record for each device, keyed by ID */
+    GCancellable *cancel;           /* Cancels a compaction in progress */
+    guint32 compact_seq;            /* Last record included in the compaction in progress */
+} Journal;
+
+typedef struct {
+    char *path;
+    GByteArray *records;
+    guint count;                    /* Records written - the new file is zero from there on */
+} JournalSnapshot;
+
+typedef struct _Inhibitor {
+    GDBusConnection *bus;
+    GCancellable *cancel;           /* Cancels everything outstanding when the plugin goes */
+    guint sleep_sub;
+    guint shutdown_sub;
+    int fd;                         /* Delay lock - -1 when not held */
+    int pending;                    /* Mounts still being flushed in this round */
+    guint round;                    /* Bumped by each flush and deadline, so late completions are ignored */
+    guint deadline;
+} Inhibitor;
+
+typedef struct {
+    EjecterPlugin *ej;
+    GCancellable *cancel;
+    GDrive *drv;
+    GMount *mnt;
+    gint64 start;
+    guint round;                    /* Flush this belongs to */
+} FlushOp;
+
+typedef struct {
+    gint64 time;
+    guint64 rd_sectors;
+    guint64 wr_sectors;
+    guint inflight;
+} IoSample;
+
+typedef struct {
+    char *uri;
+    gint64 start;
+} OpenOp;
+
+typedef void (*PrefetchWaitFunc) (gpointer data);
+
+/* Something held back until prefetch workers have let go of a mount */
+typedef struct {
+    int pending;
+    PrefetchWaitFunc func;
+    gpointer data;
+} PrefetchWait;
+
+typedef struct {
+    EjecterPlugin *ej;              /* NULL once the plugin has gone */
+    char *path;                     /* Mount root being read */
+    GCancellable *cancel;
+    GList *waiters;                 /* PrefetchWaits released when the worker exits */
+} Prefetch;
+
+typedef enum {
+    ACT_NONE,
+    ACT_SAFE,
+    ACT_IDLE,
+    ACT_WRITING,
+    ACT_FLUSHING
+} ActState;
+
+typedef struct {
+    char dev[32];
+    IoSample ring[IO_RING_LEN];
+    int head;
+    int count;
+} IoStat;
+
+typedef struct {
+    char *name;
+    guint64 size;
+    guint64 free;
+    gint64 time;
+    gboolean valid;
+    gboolean pending;
+} FsInfo;
+
+typedef struct {
+    EjecterPlugin *ej;
+    GCancellable *cancel;
+    char *path;
+} FsQuery;
+
+typedef struct {
+    GtkWidget *label;
+    char *text;
+    IoStat *io;
+    GList *paths;
+} MenuEntry;
+
+typedef struct {
+    EjecterPlugin *ej;
+    char *name;
+    GList *drives;
+    GtkWidget *submenu;
+} MenuGroup;
+
 /*----------------------------------------------------------------------------*/
 /* Global data                                                                */
 /*----------------------------------------------------------------------------*/
 
-conf_table_t conf_table[3] = {
+/* Main loop stalls, oldest overwritten first - only touched on the main thread */
+static Stall stall_ring[STALL_RING];
+static int stall_head, stall_count;
+static gint64 stall_threshold = STALL_DEFAULT_MS * 1000;
+static gboolean stall_log;
+
+/* Shared by every instance, as the helpers are called from places with no plugin to hand */
+static MemCount mem_counts[MEM_TAGS];
+static const char *mem_tags[MEM_TAGS] = { "tracking", "menu", "notifications", "async" };
+static gsize mem_budget;
+static gboolean mem_over;
+G_LOCK_DEFINE_STATIC (mem);
+
+/* strictlimit first, so the drive's share is enforced before it is set */
+static const char *bdi_attrs[BDI_ATTRS] = { "strict_limit", "max_bytes", "max_ratio" };
+
+/* Only said once - without the udev rule no drive can be limited */
+static gboolean bdi_warned;
+
+conf_table_t conf_table[5] = {
     {CONF_TYPE_BOOL, "autohide",    N_("Hide icon when no devices"),    NULL},
     {CONF_TYPE_BOOL, "automount",   N_("Automount removable devices"),  NULL},
+    {CONF_TYPE_BOOL, "prefetch",    N_("Read folders in advance after mounting"),  NULL},
+    {CONF_TYPE_INT,  "max_eject",   N_("Longest time to eject in seconds (0 for no limit)"),  NULL},
     {CONF_TYPE_NONE,  NULL,         NULL,                               NULL}
 };
 
@@ -73,6 +331,20 @@ conf_table_t conf_table[3] = {
 /* Prototypes                                                                 */
 /*----------------------------------------------------------------------------*/
 
+static void stall_check (const char *name, const char *event, gpointer obj, gint64 start);
+static void control_stalls (GString *reply);
+static void mem_count (MemTag tag, gsize size, gboolean alloc);
+static gpointer mem_alloc (MemTag tag, gsize size);
+static gsize mem_size (gconstpointer data);
+static char *mem_strdup (MemTag tag, const char *str);
+static char *mem_take_str (MemTag tag, char *str);
+static GList *mem_list_append (MemTag tag, GList *list, gpointer data);
+static GList *mem_list_remove (MemTag tag, GList *list, gconstpointer data);
+static void mem_list_free (MemTag tag, GList *list, GDestroyNotify free_func);
+static gpointer mem_dup (MemTag tag, gconstpointer data, gsize size);
+static void mem_free (gpointer data);
+static void control_memstats (EjecterPlugin *ej, GString *reply);
+static void mem_by_device (GHashTable *devs, GHashTable *table, gboolean keys);
 static void log_eject (EjecterPlugin *ej, GDrive *drive);
 static gboolean was_ejected (EjecterPlugin *ej, GDrive *drive);
 static void log_mount (EjecterPlugin *ej, GMount *mount);
@@ -83,32 +355,263 @@ static void handle_mount_in (GtkWidget *, GMount *mount, gpointer data);
 static void handle_mount_out (GtkWidget *, GMount *mount, gpointer data);
 static void handle_mount_pre (GtkWidget *, GMount *mount, gpointer data);
 static void handle_volume_in (GtkWidget *, GVolume *vol, gpointer data);
+static void automount_volume (EjecterPlugin *ej, GVolume *vol, gboolean notify);
+static void mount_done (GVolume *vol, GAsyncResult *res, gpointer data);
+static void mount_bus_ready (GObject *, GAsyncResult *res, gpointer data);
+static void mount_udisks_done (GObject *source_object, GAsyncResult *res, gpointer data);
+static void mount_connected (EjecterPlugin *ej, MountCall *call, const char *path);
+static void free_mount_call (MountCall *call);
+static char *udev_get_property (const char *dev, const char *key);
+static GKeyFile *profile_load (void);
+static gboolean profile_matches (GKeyFile *kf, const char *group, const char *key, const char *value);
+static char *profile_find (EjecterPlugin *ej, GVolume *vol, char **name);
 static void handle_volume_out (GtkWidget *, GVolume *vol, gpointer data);
 static void handle_drive_in (GtkWidget *, GDrive *drive, gpointer data);
 static void handle_drive_out (GtkWidget *, GDrive *drive, gpointer data);
 static void handle_eject_clicked (GtkWidget *widget, gpointer ptr);
-static void eject_done (GObject *source_object, GAsyncResult *res, gpointer ptr);
-static void stop_done (GObject *source_object, GAsyncResult *res, gpointer ptr);
-static void vol_unmount_done (GObject *source_object, GAsyncResult *res, gpointer ptr);
-static void vol_eject_done (GObject *source_object, GAsyncResult *res, gpointer ptr);
+static void eject_drive (EjecterPlugin *ej, GDrive *drv, EjectVerb verb);
+static void eject_drive_start (gpointer data);
+static void eject_finished (GDrive *drv, EjectVerb verb, GError *err, const EjectTimes *times, gpointer data);
+static void record_stats (EjecterPlugin *ej, GDrive *drv, GError *err, const EjectTimes *times);
 static gboolean is_drive_mounted (GDrive *d);
-static void update_icon (EjecterPlugin *ej);
+static void update_icon (EjecterPlugin *ej, GDrive *drv);
 static void show_menu (EjecterPlugin *ej);
 static void hide_menu (EjecterPlugin *ej);
 static GtkWidget *create_menuitem (EjecterPlugin *ej, GDrive *d);
+static void add_drive_item (EjecterPlugin *ej, GtkWidget *menu, GDrive *drv, GList **batch);
+static char *get_drive_group (GDrive *d);
+static const char *drive_group (EjecterPlugin *ej, GDrive *d);
+static void add_group_item (EjecterPlugin *ej, MenuGroup *grp);
+static void populate_group (GtkWidget *, gpointer data);
+static void handle_eject_group (GtkWidget *, gpointer data);
+static void free_menu_group (gpointer data, GClosure *);
+static void free_callback_data (gpointer data, GClosure *);
+static GtkWidget *find_menu_label (GtkWidget *widget);
+static gboolean read_io_sample (const char *dev, IoSample *s);
+static void io_sample_all (EjecterPlugin *ej);
+static void io_format (IoStat *io, GString *str);
+static void fs_query_mounts (EjecterPlugin *ej, GList *mounts);
+static void fs_query_done (GObject *source_object, GAsyncResult *res, gpointer data);
+static void fs_invalidate (EjecterPlugin *ej, GMount *mount);
+static void fs_format (EjecterPlugin *ej, GList *paths, GString *str);
+static void free_fs_info (gpointer data);
+static void update_tooltip (EjecterPlugin *ej);
+static void update_menu_labels (EjecterPlugin *ej);
+static gboolean io_tick (gpointer data);
+static void io_monitor_start (EjecterPlugin *ej);
+static void io_monitor_stop (EjecterPlugin *ej);
+static void free_menu_entry (gpointer data);
 static void ejecter_button_clicked (GtkWidget *, EjecterPlugin * ej);
+static void index_refresh (EjecterPlugin *ej);
+static void control_list (EjecterPlugin *ej, GString *reply);
+static const char *get_stable_id (EjecterPlugin *ej, GDrive *drv);
+static guint32 journal_crc (const JournalRecord *rec);
+static JournalRecord *journal_map (const char *path);
+static Journal *journal_open (void);
+static void journal_close (Journal *j);
+static void journal_append (Journal *j, JournalRecord *rec);
+static void journal_write (EjecterPlugin *ej, GDrive *drv, JournalState state, const DevStats *st);
+static void journal_compact (Journal *j);
+static gint journal_prune_order (gconstpointer a, gconstpointer b);
+static void journal_prune (Journal *j);
+static void journal_compact_thread (GTask *task, gpointer source, gpointer data, GCancellable *cancel);
+static void free_journal_snapshot (gpointer data);
+static void journal_compact_done (GObject *source_object, GAsyncResult *res, gpointer data);
+static void journal_restore (EjecterPlugin *ej);
+static void inhibit_init (EjecterPlugin *ej);
+static void inhibit_connected (GObject *source_object, GAsyncResult *res, gpointer data);
+static void inhibit_take (EjecterPlugin *ej);
+static void inhibit_taken (GObject *source_object, GAsyncResult *res, gpointer data);
+static void inhibit_release (EjecterPlugin *ej);
+static void inhibit_signal (GDBusConnection *, const char *, const char *, const char *, const char *signal, GVariant *params, gpointer data);
+static void inhibit_close (Inhibitor *ih);
+static void flush_all (EjecterPlugin *ej);
+static gboolean flush_deadline (gpointer data);
+static void flush_thread (gpointer data, gpointer);
+static void flush_synced (GObject *source_object, GAsyncResult *res, gpointer data);
+static void flush_unmount (gpointer data);
+static void flush_unmounted (GObject *source_object, GAsyncResult *res, gpointer data);
+static void flush_op_done (FlushOp *op);
+static void control_stats (EjecterPlugin *ej, GString *reply);
+static void control_reply (GString *reply);
+static ActState act_sample (EjecterPlugin *ej, gboolean *busy);
+static gboolean act_tick (gpointer data);
+static void act_kick (EjecterPlugin *ej);
+static void act_set_base (EjecterPlugin *ej);
+static GdkPixbuf *act_render (EjecterPlugin *ej, ActState state);
+static void act_show (EjecterPlugin *ej, ActState state);
+static void prefetch_start (EjecterPlugin *ej, const char *mount_path);
+static char *sysfs_read (const char *path);
+static gboolean sysfs_write (const char *path, const char *val);
+static void bdi_limit (EjecterPlugin *ej, GDrive *drv);
+static void bdi_apply (EjecterPlugin *ej, BdiLimit *bl);
+static void bdi_restore (EjecterPlugin *ej, GDrive *drv);
+static void free_bdi_limit (gpointer data);
+static void prefetch_thread (GTask *task, gpointer source, gpointer data, GCancellable *cancel);
+static void prefetch_done (GObject *source_object, GAsyncResult *res, gpointer data);
+static void free_prefetch (gpointer data);
+static Prefetch *prefetch_cancel (EjecterPlugin *ej, GMount *mnt);
+static void prefetch_wait (EjecterPlugin *ej, GDrive *drv, GMount *mnt, PrefetchWaitFunc func, gpointer data);
+static void prefetch_hold (EjecterPlugin *ej, GMount *mnt, PrefetchWait *w);
+static void prefetch_release (PrefetchWait *w);
+static void prefetch_cancel_all (EjecterPlugin *ej);
+static void prefetch_detach_all (EjecterPlugin *ej);
+#ifndef LXPLUG
+static void open_mount_shown (GObject *source_object, GAsyncResult *res, gpointer data);
+static void open_mount_launch (OpenOp *op);
+static void free_open_op (OpenOp *op);
+#endif
 
 /*----------------------------------------------------------------------------*/
 /* Function definitions                                                       */
 /*----------------------------------------------------------------------------*/
 
+/* Stall watchdog - the watch function for every WATCHDOG, the plugin's and
+ * the eject engine's; only those that hold up the main loop are recorded */
+
+static void stall_check (const char *name, const char *event, gpointer obj, gint64 start)
+{
+    gint64 duration = g_get_monotonic_time () - start;
+    char *dev = NULL;
+    Stall *st;
+
+    if (duration < stall_threshold) return;
+
+    if (G_IS_DRIVE (obj)) dev = g_drive_get_identifier (G_DRIVE (obj), G_DRIVE_IDENTIFIER_KIND_UNIX_DEVICE);
+    else if (G_IS_VOLUME (obj)) dev = g_volume_get_identifier (G_VOLUME (obj), G_VOLUME_IDENTIFIER_KIND_UNIX_DEVICE);
+    else if (G_IS_MOUNT (obj)) dev = eject_get_mount_path (G_MOUNT (obj));
+
+    st = &stall_ring[stall_head];
+    stall_head = (stall_head + 1) % STALL_RING;
+    if (stall_count < STALL_RING) stall_count++;
+    st->when = g_get_real_time ();
+    st->duration = duration;
+    st->name = name;
+    st->event = event;
+    g_strlcpy (st->dev, dev ? dev : "-", sizeof (st->dev));
+
+    if (stall_log) g_warning ("ejecter: %s (%s) on %s held up the main loop for %" G_GINT64_FORMAT " ms",
+        st->name, st->event, st->dev, duration / 1000);
+    g_free (dev);
+}
+
+/* Accounted allocation - each block carries its size and tag in a header
+ * ahead of the pointer returned, so it can be freed without either */
+
+static gpointer mem_alloc (MemTag tag, gsize size)
+{
+    guint8 *block = g_malloc0 (MEM_HEADER + size);
+
+    *(gsize *) block = size;
+    *(MemTag *) (block + sizeof (gsize)) = tag;
+    mem_count (tag, size, TRUE);
+    return block + MEM_HEADER;
+}
+
+/* Count a block against a subsystem as allocated or freed - used directly
+ * for memory GLib hands out, such as list nodes */
+
+static void mem_count (MemTag tag, gsize size, gboolean alloc)
+{
+    gsize total = 0;
+    gboolean over = FALSE;
+    int i;
+
+    G_LOCK (mem);
+    if (alloc)
+    {
+        mem_counts[tag].live += size;
+        mem_counts[tag].allocs++;
+        if (mem_counts[tag].live > mem_counts[tag].peak) mem_counts[tag].peak = mem_counts[tag].live;
+        for (i = 0; i < MEM_TAGS; i++) total += mem_counts[i].live;
+        over = mem_budget && total > mem_budget && !mem_over;
+        if (over) mem_over = TRUE;
+    }
+    else
+    {
+        mem_counts[tag].live -= size;
+        mem_counts[tag].frees++;
+    }
+    G_UNLOCK (mem);
+
+    /* only reported once - run with G_DEBUG=fatal-criticals to make it fail a test */
+    if (over) g_critical ("ejecter: %" G_GSIZE_FORMAT " bytes allocated, over budget of %" G_GSIZE_FORMAT " (%s)",
+        total, mem_budget, mem_tags[tag]);
+}
+
+static gsize mem_size (gconstpointer data)
+{
+    return data ? *(const gsize *) ((const guint8 *) data - MEM_HEADER) : 0;
+}
+
+static char *mem_strdup (MemTag tag, const char *str)
+{
+    return str ? mem_dup (tag, str, strlen (str) + 1) : NULL;
+}
+
+/* Move a string GLib allocated into an accounted block */
+
+static char *mem_take_str (MemTag tag, char *str)
+{
+    char *res = mem_strdup (tag, str);
+    g_free (str);
+    return res;
+}
+
+static GList *mem_list_append (MemTag tag, GList *list, gpointer data)
+{
+    mem_count (tag, sizeof (GList), TRUE);
+    return g_list_append (list, data);
+}
+
+static GList *mem_list_remove (MemTag tag, GList *list, gconstpointer data)
+{
+    GList *link = g_list_find (list, data);
+
+    if (!link) return list;
+    mem_count (tag, sizeof (GList), FALSE);
+    return g_list_delete_link (list, link);
+}
+
+static void mem_list_free (MemTag tag, GList *list, GDestroyNotify free_func)
+{
+    GList *l;
+
+    for (l = list; l != NULL; l = l->next) mem_count (tag, sizeof (GList), FALSE);
+    if (free_func) g_list_free_full (list, free_func);
+    else g_list_free (list);
+}
+
+static gpointer mem_dup (MemTag tag, gconstpointer data, gsize size)
+{
+    gpointer block = mem_alloc (tag, size);
+    memcpy (block, data, size);
+    return block;
+}
+
+static void mem_free (gpointer data)
+{
+    guint8 *block;
+    MemTag tag;
+    gsize size;
+
+    if (!data) return;
+    block = (guint8 *) data - MEM_HEADER;
+    size = *(gsize *) block;
+    tag = *(MemTag *) (block + sizeof (gsize));
+
+    mem_count (tag, size, FALSE);
+    g_free (block);
+}
+
 static void log_eject (EjecterPlugin *ej, GDrive *drive)
 {
     EjectList *el;
-    el = g_new (EjectList, 1);
+    el = mem_new0 (EjectList, MEM_TRACKING);
     el->drv = drive;
     el->seq = -1;
-    ej->ejdrives = g_list_append (ej->ejdrives, el);
+    ej->ejdrives = mem_list_append (MEM_TRACKING, ej->ejdrives, el);
+    journal_write (ej, drive, JS_EJECTED, NULL);
 }
 
 static gboolean was_ejected (EjecterPlugin *ej, GDrive *drive)
@@ -122,8 +625,8 @@ static gboolean was_ejected (EjecterPlugin *ej, GDrive *drive)
         {
             ejected = TRUE;
             if (el->seq != -1) wrap_notify_clear (el->seq);
-            ej->ejdrives = g_list_remove (ej->ejdrives, el);
-            g_free (el);
+            ej->ejdrives = mem_list_remove (MEM_TRACKING, ej->ejdrives, el);
+            mem_free (el);
         }
     }
     return ejected;
@@ -133,6 +636,10 @@ static void log_mount (EjecterPlugin *ej, GMount *mount)
 {
     GList *l;
     GDrive *drv, *drive = g_mount_get_drive (mount);
+
+    /* on every mount, as an eject lifts the limit without forgetting the drive */
+    if (drive) bdi_limit (ej, drive);
+
     for (l = ej->mdrives; l != NULL; l = l->next)
     {
         drv = (GDrive *) l->data;
@@ -143,8 +650,9 @@ static void log_mount (EjecterPlugin *ej, GMount *mount)
         }
     }
 
-    ej->mdrives = g_list_append (ej->mdrives, drive);
+    ej->mdrives = mem_list_append (MEM_TRACKING, ej->mdrives, drive);
     DEBUG ("MOUNTED DRIVE %s", g_drive_get_name (drive));
+    if (drive) journal_write (ej, drive, JS_MOUNTED, NULL);
     g_object_unref (drive);
 }
 
@@ -166,7 +674,7 @@ static gboolean was_mounted (EjecterPlugin *ej, GDrive *drive)
         drv = (GDrive *) l->data;
         if (drv == drive)
         {
-            ej->mdrives = g_list_remove (ej->mdrives, drv);
+            ej->mdrives = mem_list_remove (MEM_TRACKING, ej->mdrives, drv);
             return TRUE;
         }
     }
@@ -189,101 +697,336 @@ static void add_seq_for_drive (EjecterPlugin *ej, GDrive *drive, int seq)
 
 static void handle_mount_in (GtkWidget *, GMount *mount, gpointer data)
 {
+    WATCHDOG ("mount-added", mount);
     EjecterPlugin *ej = (EjecterPlugin *) data;
     DEBUG ("MOUNT ADDED %s", g_mount_get_name (mount));
+    ej->index_dirty = TRUE;
 
     log_mount (ej, mount);
+    fs_invalidate (ej, mount);
+    GList *mnts = g_list_append (NULL, g_object_ref (mount));
+    fs_query_mounts (ej, mnts);
+    g_list_free_full (mnts, g_object_unref);
+
     if (ej->menu && gtk_widget_get_visible (ej->menu)) show_menu (ej);
-    update_icon (ej);
+    GDrive *drv = g_mount_get_drive (mount);
+    update_icon (ej, drv);
+    if (drv) g_object_unref (drv);
 }
 
 static void handle_mount_out (GtkWidget *, GMount *mount, gpointer data)
 {
+    WATCHDOG ("mount-removed", mount);
     EjecterPlugin *ej = (EjecterPlugin *) data;
     DEBUG ("MOUNT REMOVED %s", g_mount_get_name (mount));
+    ej->index_dirty = TRUE;
+
+    fs_invalidate (ej, mount);
+    update_tooltip (ej);
 
     if (ej->menu && gtk_widget_get_visible (ej->menu)) show_menu (ej);
-    update_icon (ej);
+    GDrive *drv = g_mount_get_drive (mount);
+    update_icon (ej, drv);
+    if (drv) g_object_unref (drv);
 }
 
 static void handle_mount_pre (GtkWidget *, GMount *mount, gpointer data)
 {
+    WATCHDOG ("mount-pre-unmount", mount);
     EjecterPlugin *ej = (EjecterPlugin *) data;
     DEBUG ("MOUNT PREUNMOUNT %s", g_mount_get_name (mount));
+    ej->index_dirty = TRUE;
+    prefetch_cancel (ej, mount);
     log_eject (ej, g_mount_get_drive (mount));
 }
 
-static void mount_done (GVolume *vol, GAsyncResult *res, gpointer)
+/* Mount with the options from a matching profile through UDisks, which
+ * GVolume has no way to pass on, or as GIO would otherwise */
+
+static void automount_volume (EjecterPlugin *ej, GVolume *vol, gboolean notify)
+{
+    MountCall *call = mem_new0 (MountCall, MEM_ASYNC);
+
+    call->ej = ej;
+    call->cancel = g_object_ref (ej->cancel);
+    call->vol = g_object_ref (vol);
+    call->notify = notify;
+
+    call->opts = profile_find (ej, vol, &call->profile);
+    call->dev = g_volume_get_identifier (vol, G_VOLUME_IDENTIFIER_KIND_UNIX_DEVICE);
+    if (call->opts && call->dev) g_bus_get (G_BUS_TYPE_SYSTEM, call->cancel, mount_bus_ready, call);
+    else
+    {
+        g_clear_pointer (&call->profile, g_free);
+        g_volume_mount (vol, 0, NULL, NULL, (GAsyncReadyCallback) mount_done, call);
+    }
+}
+
+static void mount_bus_ready (GObject *, GAsyncResult *res, gpointer data)
 {
-    if (g_volume_mount_finish (vol, res, NULL))
+    WATCHDOG ("mount", ((MountCall *) data)->vol);
+    MountCall *call = (MountCall *) data;
+    GDBusConnection *bus = g_bus_get_finish (res, NULL);
+    GVariantBuilder args;
+    char *path;
+
+    if (g_cancellable_is_cancelled (call->cancel))
+    {
+        if (bus) g_object_unref (bus);
+        free_mount_call (call);
+        return;
+    }
+
+    if (!bus)
+    {
+        g_clear_pointer (&call->profile, g_free);
+        g_volume_mount (call->vol, 0, NULL, NULL, (GAsyncReadyCallback) mount_done, call);
+        return;
+    }
+
+    DEBUG ("MOUNT %s WITH PROFILE %s (%s)", call->dev, call->profile, call->opts);
+    g_variant_builder_init (&args, G_VARIANT_TYPE ("a{sv}"));
+    g_variant_builder_add (&args, "{sv}", "options", g_variant_new_string (call->opts));
+    path = eject_udisks_path (call->dev + 5);
+    g_dbus_connection_call (bus, UDISKS_NAME, path, UDISKS_NAME ".Filesystem", "Mount", g_variant_new ("(a{sv})", &args),
+        G_VARIANT_TYPE ("(s)"), G_DBUS_CALL_FLAGS_NONE, -1, NULL, mount_udisks_done, call);
+    g_object_unref (bus);
+    g_free (path);
+}
+
+static void mount_done (GVolume *vol, GAsyncResult *res, gpointer data)
+{
+    WATCHDOG ("mount", vol);
+    MountCall *call = (MountCall *) data;
+
+    if (g_volume_mount_finish (vol, res, NULL) && !g_cancellable_is_cancelled (call->cancel))
     {
-#ifndef LXPLUG
-        GDrive *drv = g_volume_get_drive (vol);
         GMount *mnt = g_volume_get_mount (vol);
-        GFile *root = g_mount_get_root (mnt);
+        if (mnt)
+        {
+            char *path = eject_get_mount_path (mnt);
+            mount_connected (call->ej, call, path);
+            g_free (path);
+            g_object_unref (mnt);
+        }
+    }
+    free_mount_call (call);
+}
+
+static void mount_udisks_done (GObject *source_object, GAsyncResult *res, gpointer data)
+{
+    WATCHDOG ("mount", ((MountCall *) data)->vol);
+    MountCall *call = (MountCall *) data;
+    GError *err = NULL;
+    GVariant *ret;
+    char *path;
+
+    ret = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source_object), res, &err);
+    if (g_cancellable_is_cancelled (call->cancel))
+    {
+        if (ret) g_variant_unref (ret);
+        if (err) g_error_free (err);
+        free_mount_call (call);
+        return;
+    }
+
+    /* UDisks refuses options it does not allow for the filesystem - mount it the usual way instead */
+    if (!ret)
+    {
+        DEBUG ("MOUNT WITH PROFILE %s FAILED %s", call->profile, err->message);
+        g_error_free (err);
+        g_clear_pointer (&call->profile, g_free);
+        g_volume_mount (call->vol, 0, NULL, NULL, (GAsyncReadyCallback) mount_done, call);
+        return;
+    }
+
+    g_variant_get (ret, "(&s)", &path);
+    mount_connected (call->ej, call, path);
+    g_variant_unref (ret);
+    free_mount_call (call);
+}
+
+static void mount_connected (EjecterPlugin *ej, MountCall *call, const char *path)
+{
+    GDrive *drv = g_volume_get_drive (call->vol);
+    char *id;
+
+    if (!drv) return;
+
+    /* note the profile against the drive, for stats */
+    id = g_drive_get_identifier (drv, G_DRIVE_IDENTIFIER_KIND_UNIX_DEVICE);
+    if (id)
+    {
+        DevStats *st = g_hash_table_lookup (ej->stats, id);
+        if (!st)
+        {
+            st = mem_new0 (DevStats, MEM_TRACKING);
+            g_hash_table_insert (ej->stats, mem_take_str (MEM_TRACKING, id), st);
+        }
+        else g_free (id);
+        g_strlcpy (st->profile, call->profile ? call->profile : "", sizeof (st->profile));
+    }
+
+    if (ej->prefetch) prefetch_start (ej, path);
+
+#ifndef LXPLUG
+    if (call->notify)
+    {
         char *name = g_drive_get_name (drv);
-        char *msg = g_strdup_printf (_("Removable drive %s connected"), name);
-        char *path = g_file_get_path (root);
+        char *msg;
+
+        if (call->profile) msg = g_strdup_printf (_("Removable drive %s connected\nMounted using profile %s"), name, call->profile);
+        else msg = g_strdup_printf (_("Removable drive %s connected"), name);
 
         GNotification *not = g_notification_new (msg);
         g_notification_add_button_with_target (not, _("Open"), "app.open-mount", "s", path);
         g_application_send_notification (g_application_get_default (), name, not);
         g_object_unref (not);
 
-        g_free (path);
         g_free (msg);
         g_free (name);
-        g_object_unref (root);
-        g_object_unref (mnt);
-        g_object_unref (drv);
-#endif
     }
+#endif
+    g_object_unref (drv);
+}
+
+static void free_mount_call (MountCall *call)
+{
+    g_object_unref (call->cancel);
+    g_object_unref (call->vol);
+    g_free (call->profile);
+    g_free (call->opts);
+    g_free (call->dev);
+    mem_free (call);
 }
 
 #ifndef LXPLUG
 static gboolean open_mount (GSimpleAction *, GVariant *param, gpointer)
 {
-    char *cmd = g_strdup_printf ("pcmanfm %s &", g_variant_get_string (param, NULL));
-    system (cmd);
-    g_free (cmd);
+    WATCHDOG ("open", NULL);
+    GDBusConnection *bus = g_application_get_dbus_connection (g_application_get_default ());
+    const char *uris[2] = { NULL, NULL };
+    OpenOp *op;
+
+    op = mem_new0 (OpenOp, MEM_NOTIFY);
+    op->start = g_get_monotonic_time ();
+    op->uri = g_filename_to_uri (g_variant_get_string (param, NULL), NULL, NULL);
+    if (!op->uri)
+    {
+        free_open_op (op);
+        return FALSE;
+    }
+
+    /* a file manager that is already running can just open another window */
+    if (bus)
+    {
+        uris[0] = op->uri;
+        g_dbus_connection_call (bus, FILEMANAGER_NAME, FILEMANAGER_PATH, FILEMANAGER_NAME, "ShowFolders",
+            g_variant_new ("(^ass)", uris, ""), NULL, G_DBUS_CALL_FLAGS_NO_AUTO_START, -1, NULL, open_mount_shown, op);
+    }
+    else open_mount_launch (op);
     return FALSE;
 }
+
+static void open_mount_shown (GObject *source_object, GAsyncResult *res, gpointer data)
+{
+    WATCHDOG ("open", NULL);
+    OpenOp *op = (OpenOp *) data;
+    GVariant *ret;
+
+    ret = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source_object), res, NULL);
+    if (!ret)
+    {
+        open_mount_launch (op);
+        return;
+    }
+
+    DEBUG ("OPENED %s through file manager service in %" G_GINT64_FORMAT " ms", op->uri, (g_get_monotonic_time () - op->start) / 1000);
+    g_variant_unref (ret);
+    free_open_op (op);
+}
+
+static void open_mount_launch (OpenOp *op)
+{
+    GAppLaunchContext *ctx = G_APP_LAUNCH_CONTEXT (gdk_display_get_app_launch_context (gdk_display_get_default ()));
+    GList *uris = g_list_append (NULL, op->uri);
+    GError *err = NULL;
+    GAppInfo *app;
+
+    /* no shell in between, so the path needs no quoting */
+    app = g_app_info_get_default_for_type ("inode/directory", TRUE);
+    if (!app) app = g_app_info_create_from_commandline ("pcmanfm", NULL, G_APP_INFO_CREATE_SUPPORTS_URIS, NULL);
+
+    if (app && g_app_info_launch_uris (app, uris, ctx, &err))
+    {
+        DEBUG ("OPENED %s with %s in %" G_GINT64_FORMAT " ms", op->uri, g_app_info_get_id (app), (g_get_monotonic_time () - op->start) / 1000);
+    }
+    else if (err)
+    {
+        DEBUG ("OPEN %s FAILED %s", op->uri, err->message);
+        g_error_free (err);
+    }
+
+    if (app) g_object_unref (app);
+    g_object_unref (ctx);
+    g_list_free (uris);
+    free_open_op (op);
+}
+
+static void free_open_op (OpenOp *op)
+{
+    g_free (op->uri);
+    mem_free (op);
+}
 #endif
 
 static void handle_volume_in (GtkWidget *, GVolume *vol, gpointer data)
 {
+    WATCHDOG ("volume-added", vol);
     EjecterPlugin *ej = (EjecterPlugin *) data;
     DEBUG ("VOLUME ADDED %s", g_volume_get_name (vol));
+    ej->index_dirty = TRUE;
 
     if (ej->automount && g_volume_should_automount (vol) && g_volume_can_mount (vol) && !g_volume_get_mount (vol))
-        g_volume_mount (vol, 0, NULL, NULL, (GAsyncReadyCallback) mount_done, NULL);
+        automount_volume (ej, vol, TRUE);
 
     if (ej->menu && gtk_widget_get_visible (ej->menu)) show_menu (ej);
-    update_icon (ej);
+    GDrive *drv = g_volume_get_drive (vol);
+    update_icon (ej, drv);
+    if (drv) g_object_unref (drv);
 }
 
 static void handle_volume_out (GtkWidget *, GVolume *vol, gpointer data)
 {
+    WATCHDOG ("volume-removed", vol);
     EjecterPlugin *ej = (EjecterPlugin *) data;
     DEBUG ("VOLUME REMOVED %s", g_volume_get_name (vol));
+    ej->index_dirty = TRUE;
 
     if (ej->menu && gtk_widget_get_visible (ej->menu)) show_menu (ej);
-    update_icon (ej);
+    GDrive *drv = g_volume_get_drive (vol);
+    update_icon (ej, drv);
+    if (drv) g_object_unref (drv);
 }
 
 static void handle_drive_in (GtkWidget *, GDrive *drive, gpointer data)
 {
+    WATCHDOG ("drive-connected", drive);
     EjecterPlugin *ej = (EjecterPlugin *) data;
     DEBUG ("DRIVE ADDED %s", g_drive_get_name (drive));
+    ej->index_dirty = TRUE;
+    drive_group (ej, drive);
 
     if (ej->menu && gtk_widget_get_visible (ej->menu)) show_menu (ej);
-    update_icon (ej);
+    update_icon (ej, drive);
 }
 
 static void handle_drive_out (GtkWidget *, GDrive *drive, gpointer data)
 {
+    WATCHDOG ("drive-disconnected", drive);
     EjecterPlugin *ej = (EjecterPlugin *) data;
     DEBUG ("DRIVE REMOVED %s", g_drive_get_name (drive));
+    ej->index_dirty = TRUE;
 
     if (was_mounted (ej, drive) && !was_ejected (ej, drive))
     {
@@ -299,370 +1042,2181 @@ static void handle_drive_out (GtkWidget *, GDrive *drive, gpointer data)
         g_free (name);
     }
 
+    journal_write (ej, drive, JS_REMOVED, NULL);
+    bdi_restore (ej, drive);
+    g_hash_table_remove (ej->drive_ids, drive);
+    g_hash_table_remove (ej->drive_groups, drive);
+
     if (ej->menu && gtk_widget_get_visible (ej->menu)) show_menu (ej);
-    update_icon (ej);
+    update_icon (ej, drive);
 }
 
 static void handle_eject_clicked (GtkWidget *, gpointer data)
 {
+    WATCHDOG ("menu", ((CallbackData *) data)->drv);
     CallbackData *dt = (CallbackData *) data;
-    EjecterPlugin *ej = dt->ej;
-    GDrive *drv = dt->drv;
-    char *id = g_drive_get_identifier (drv, G_DRIVE_IDENTIFIER_KIND_UNIX_DEVICE);
+    eject_drive (dt->ej, dt->drv, VERB_AUTO);
+}
+
+static void eject_drive (EjecterPlugin *ej, GDrive *drv, EjectVerb verb)
+{
+    AsyncCall *call = mem_new0 (AsyncCall, MEM_ASYNC);
+    call->ej = ej;
+    call->cancel = g_object_ref (ej->cancel);
+    call->drv = g_object_ref (drv);
+    call->verb = verb;
+
     DEBUG ("EJECT %s", g_drive_get_name (drv));
+    ej->ejecting++;
+    act_kick (ej);
 
-    // this should probably be replaced with a proper less hacky test at some point...
-    if (g_drive_is_media_removable (drv) && !strstr (id, "mmcblk0"))
-    {
-        DEBUG ("EJECTING DRIVE");
-        g_drive_eject_with_operation (drv, G_MOUNT_UNMOUNT_NONE, NULL, NULL, eject_done, ej);
-    }
-    else if (g_drive_can_stop (drv))
-    {
-        DEBUG ("STOPPING DRIVE");
-        g_drive_stop (drv, G_MOUNT_UNMOUNT_NONE, NULL, NULL, stop_done, ej);
-    }
-    else
-    {
-        DEBUG ("EJECTING VOLUMES");
+    /* a cancelled prefetch can still have a directory open on the drive,
+     * which would fail the unmount as busy - wait for it to finish */
+    prefetch_wait (ej, drv, NULL, eject_drive_start, call);
+}
 
-        GList *vols, *iter;
-        GVolume *v;
-        vols = g_drive_get_volumes (drv);
-        for (iter = vols; iter != NULL; iter = g_list_next (iter))
-        {
-            v = (GVolume *) iter->data;
-            GMount *mnt = g_volume_get_mount (v);
-            if (mnt)
-            {
-                CallbackData *dtn = g_new0 (CallbackData, 1);
-                dtn->ej = ej;
-                dtn->drv = drv;
-                if (g_mount_can_eject (mnt))
-                {
-                    DEBUG ("EJECTING VOLUME");
-                    g_mount_eject_with_operation (mnt, G_MOUNT_UNMOUNT_NONE, NULL, NULL, vol_eject_done, dtn);
-                }
-                else if (g_mount_can_unmount (mnt))
-                {
-                    DEBUG ("UNMOUNTING VOLUME");
-                    g_mount_unmount_with_operation (mnt, G_MOUNT_UNMOUNT_NONE, NULL, NULL, vol_unmount_done, dtn);
-                }
-                else
-                {
-                    DEBUG ("CANNOT EJECT OR UNMOUNT");
-                }
-                g_object_unref (mnt);
-                break;
-            }
-            if (mnt) g_object_unref (mnt);
-        }
-        g_list_free_full (vols, g_object_unref);
+static void eject_drive_start (gpointer data)
+{
+    AsyncCall *call = (AsyncCall *) data;
+    GDrive *drv = call->drv;
+
+    call->drv = NULL;
+    if (g_cancellable_is_cancelled (call->cancel))
+    {
+        g_object_unref (call->cancel);
+        mem_free (call);
     }
-    g_free (id);
+    else eject_drive_async (drv, call->verb, call->cancel, eject_finished, call);
+    g_object_unref (drv);
 }
 
-static void eject_done (GObject *source_object, GAsyncResult *res, gpointer data)
+static void eject_finished (GDrive *drv, EjectVerb verb, GError *err, const EjectTimes *times, gpointer data)
 {
-    EjecterPlugin *ej = (EjecterPlugin *) data;
-    GDrive *drv = (GDrive *) source_object;
+    WATCHDOG ("eject", drv);
+    AsyncCall *call = (AsyncCall *) data;
+    EjecterPlugin *ej = call->ej;
     char *buffer, *name;
-    GError *err = NULL;
 
-    name = g_drive_get_name (drv);
-    g_drive_eject_with_operation_finish (drv, res, &err);
+    /* the plugin has gone - whatever the outcome, there is nobody to tell */
+    gboolean gone = g_cancellable_is_cancelled (call->cancel);
+    g_object_unref (call->cancel);
+    mem_free (call);
+    if (gone) return;
 
+    ej->ejecting--;
+
+    name = g_drive_get_name (drv);
+    DEBUG ("EJECT %s %s in %" G_GINT64_FORMAT " ms", name, err ? "FAILED" : "COMPLETE", times->total / 1000);
+    record_stats (ej, drv, err, times);
     if (err == NULL)
     {
-        DEBUG ("EJECT COMPLETE");
 #ifndef LXPLUG
         g_application_withdraw_notification (g_application_get_default (), name);
 #endif
-        buffer = g_strdup_printf (_("%s has been ejected\nIt is now safe to remove the device"), name);
-        add_seq_for_drive (ej, drv, wrap_notify (ej->panel, buffer));
+        bdi_restore (ej, drv);
+
+        /* a stacked filesystem GIO did not know about was unmounted through
+         * UDisks, which does not raise mount-pre-unmount */
+        GList *l;
+        for (l = ej->ejdrives; l != NULL; l = l->next)
+            if (((EjectList *) l->data)->drv == drv) break;
+        if (!l) log_eject (ej, drv);
+
+        if (verb == VERB_STOP)
+        {
+            buffer = g_strdup_printf (_("%s has been stopped\nIt is now safe to remove the device"), name);
+            wrap_notify (ej->panel, buffer);
+        }
+        else
+        {
+            if (verb == VERB_UNMOUNT)
+                buffer = g_strdup_printf (_("%s has been unmounted\nIt is now safe to remove the device"), name);
+            else
+                buffer = g_strdup_printf (_("%s has been ejected\nIt is now safe to remove the device"), name);
+            add_seq_for_drive (ej, drv, wrap_notify (ej->panel, buffer));
+        }
     }
     else
     {
-        DEBUG ("EJECT FAILED");
-        buffer = g_strdup_printf (_("Failed to eject %s\n%s"), name, err->message);
+        if (verb == VERB_STOP)
+            buffer = g_strdup_printf (_("Failed to stop %s\n%s"), name, err->message);
+        else if (verb == VERB_UNMOUNT)
+            buffer = g_strdup_printf (_("Failed to unmount %s\n%s"), name, err->message);
+        else
+            buffer = g_strdup_printf (_("Failed to eject %s\n%s"), name, err->message);
         wrap_notify (ej->panel, buffer);
     }
+    act_kick (ej);
     g_free (name);
     g_free (buffer);
 }
 
-static void stop_done (GObject *source_object, GAsyncResult *res, gpointer data)
+static void record_stats (EjecterPlugin *ej, GDrive *drv, GError *err, const EjectTimes *times)
 {
-    EjecterPlugin *ej = (EjecterPlugin *) data;
-    GDrive *drv = (GDrive *) source_object;
-    char *buffer, *name;
-    GError *err = NULL;
-
-    name = g_drive_get_name (drv);
-    g_drive_stop_finish (drv, res, &err);
+    char *id = g_drive_get_identifier (drv, G_DRIVE_IDENTIFIER_KIND_UNIX_DEVICE);
+    DevStats *st;
 
-    if (err == NULL)
+    if (!id) return;
+    st = g_hash_table_lookup (ej->stats, id);
+    if (!st)
     {
-        DEBUG ("STOP COMPLETE");
-#ifndef LXPLUG
-        g_application_withdraw_notification (g_application_get_default (), name);
-#endif
-        buffer = g_strdup_printf (_("%s has been stopped\nIt is now safe to remove the device"), name);
+        st = mem_new0 (DevStats, MEM_TRACKING);
+        g_hash_table_insert (ej->stats, mem_take_str (MEM_TRACKING, id), st);
     }
+    else g_free (id);
+
+    if (err) st->failures++;
     else
     {
-        DEBUG ("STOP FAILED");
-        buffer = g_strdup_printf (_("Failed to stop %s\n%s"), name, err->message);
+        st->ejects++;
+        st->last = *times;
+        if (times->total > st->max_total) st->max_total = times->total;
     }
-    wrap_notify (ej->panel, buffer);
-    g_free (name);
-    g_free (buffer);
+    journal_write (ej, drv, JS_NONE, st);
 }
 
-static void vol_eject_done (GObject *source_object, GAsyncResult *res, gpointer data)
-{
-    CallbackData *dt = (CallbackData *) data;
-    EjecterPlugin *ej = dt->ej;
-    GMount *mnt = (GMount *) source_object;
-    GDrive *drv = dt->drv;
-    char *buffer, *name = g_drive_get_name (drv);
-    GError *err = NULL;
+/* Persistent state journal */
 
-    g_mount_eject_with_operation_finish (mnt, res, &err);
+/* Look up a property udev recorded for a block device, such as sda or sda1 */
 
-    if (err == NULL)
-    {
-        DEBUG ("VOL EJECT COMPLETE");
-#ifndef LXPLUG
-        g_application_withdraw_notification (g_application_get_default (), name);
-#endif
-        buffer = g_strdup_printf (_("%s has been ejected\nIt is now safe to remove the device"), name);
-        wrap_notify (ej->panel, buffer);
-        add_seq_for_drive (ej, drv, wrap_notify (ej->panel, buffer));
+static char *udev_get_property (const char *dev, const char *key)
+{
+    char *path, *str, *data = NULL, *val = NULL, *tag;
+
+    path = g_strdup_printf ("%s/sys/class/block/%s/dev", eject_sysfs_root (), dev);
+    if (g_file_get_contents (path, &str, NULL, NULL))
+    {
+        g_free (path);
+        path = g_strdup_printf ("/run/udev/data/b%s", g_strstrip (str));
+        g_file_get_contents (path, &data, NULL, NULL);
+        g_free (str);
+    }
+    g_free (path);
+    if (!data) return NULL;
+
+    tag = g_strdup_printf ("\nE:%s=", key);
+    if ((str = strstr (data, tag)))
+    {
+        str += strlen (tag);
+        val = g_strndup (str, strcspn (str, "\n"));
+    }
+    g_free (tag);
+    g_free (data);
+    return val;
+}
+
+/* Mount profiles - each group in profiles.ini is a profile, and the first
+ * whose fstype, uuid and class lists all match the volume is used, eg.
+ *
+ *   [fat-sticks]
+ *   fstype=vfat;exfat
+ *   class=usb
+ *   options=noatime,flush
+ *
+ * class is the udev bus (usb, ata, ...) or mmc. read-only=true adds ro. */
+
+static GKeyFile *profile_load (void)
+{
+    GKeyFile *kf = g_key_file_new ();
+    char *path = g_build_filename (g_get_user_config_dir (), "ejecter", PROFILES_FILE, NULL);
+
+    if (!g_key_file_load_from_file (kf, path, G_KEY_FILE_NONE, NULL))
+        g_clear_pointer (&kf, g_key_file_free);
+    g_free (path);
+    return kf;
+}
+
+static gboolean profile_matches (GKeyFile *kf, const char *group, const char *key, const char *value)
+{
+    char **vals, **v;
+    gboolean res = FALSE;
+
+    vals = g_key_file_get_string_list (kf, group, key, NULL, NULL);
+    if (!vals) return TRUE;
+    for (v = vals; *v && value && !res; v++)
+        if (!g_ascii_strcasecmp (g_strstrip (*v), value)) res = TRUE;
+    g_strfreev (vals);
+    return res;
+}
+
+static char *profile_find (EjecterPlugin *ej, GVolume *vol, char **name)
+{
+    char **groups, **g, *dev, *fstype, *uuid, *class, *opts = NULL;
+
+    *name = NULL;
+    if (!ej->profiles) return NULL;
+
+    dev = g_volume_get_identifier (vol, G_VOLUME_IDENTIFIER_KIND_UNIX_DEVICE);
+    if (!dev || !g_str_has_prefix (dev, "/dev/"))
+    {
+        g_free (dev);
+        return NULL;
+    }
+    fstype = udev_get_property (dev + 5, "ID_FS_TYPE");
+    uuid = g_volume_get_identifier (vol, G_VOLUME_IDENTIFIER_KIND_UUID);
+    class = udev_get_property (dev + 5, "ID_BUS");
+    if (!class && g_str_has_prefix (dev + 5, "mmcblk")) class = g_strdup ("mmc");
+
+    groups = g_key_file_get_groups (ej->profiles, NULL);
+    for (g = groups; *g; g++)
+    {
+        if (!profile_matches (ej->profiles, *g, "fstype", fstype)) continue;
+        if (!profile_matches (ej->profiles, *g, "uuid", uuid)) continue;
+        if (!profile_matches (ej->profiles, *g, "class", class)) continue;
+
+        GString *str = g_string_new (NULL);
+        char *o = g_key_file_get_string (ej->profiles, *g, "options", NULL);
+        if (o) g_string_append (str, g_strstrip (o));
+        if (g_key_file_get_boolean (ej->profiles, *g, "read-only", NULL))
+            g_string_append (str, str->len ? ",ro" : "ro");
+        g_free (o);
+
+        opts = g_string_free (str, FALSE);
+        *name = g_strdup (*g);
+        break;
+    }
+
+    g_strfreev (groups);
+    g_free (class);
+    g_free (uuid);
+    g_free (fstype);
+    g_free (dev);
+    return opts;
+}
+
+static const char *get_stable_id (EjecterPlugin *ej, GDrive *drv)
+{
+    char *id, *dev, *str;
+
+    id = g_hash_table_lookup (ej->drive_ids, drv);
+    if (id) return id;
+
+    /* prefer the serial number udev found for the device; it survives replugging */
+    dev = eject_get_devname (drv);
+    if (!dev) return NULL;
+    id = udev_get_property (dev, "ID_SERIAL");
+    if (!id)
+    {
+        str = g_drive_get_name (drv);
+        id = g_strdup_printf ("%s:%s", str, dev);
+        g_free (str);
+    }
+    g_free (dev);
+
+    id = mem_take_str (MEM_TRACKING, id);
+    g_hash_table_insert (ej->drive_ids, g_object_ref (drv), id);
+    return id;
+}
+
+static guint32 journal_crc (const JournalRecord *rec)
+{
+    const guint8 *c = (const guint8 *) &rec->seq;
+    guint32 hash = 2166136261u ^ JOURNAL_VERSION;
+    gsize i;
+
+    /* FNV-1a - never zero, so a zeroed slot can't pass for a record */
+    for (i = 0; i < sizeof (JournalRecord) - sizeof (rec->crc); i++) hash = (hash ^ c[i]) * 16777619u;
+    return hash ? hash : 1;
+}
+
+static JournalRecord *journal_map (const char *path)
+{
+    JournalRecord *map;
+    int fd;
+
+    fd = open (path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) return NULL;
+    if (ftruncate (fd, JOURNAL_SLOTS * sizeof (JournalRecord)) < 0)
+    {
+        close (fd);
+        return NULL;
+    }
+    map = mmap (NULL, JOURNAL_SLOTS * sizeof (JournalRecord), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close (fd);
+    return map == MAP_FAILED ? NULL : map;
+}
+
+static Journal *journal_open (void)
+{
+    Journal *j = g_new0 (Journal, 1);
+    gint64 start = g_get_monotonic_time ();
+
+    j->path = g_build_filename (g_get_user_runtime_dir (), JOURNAL_FILE, NULL);
+    j->state = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, mem_free);
+    j->map = journal_map (j->path);
+    if (!j->map) return j;
+
+    /* replay up to the first slot that is unused or was only partly written */
+    for (j->pos = 0; j->pos < JOURNAL_SLOTS; j->pos++)
+    {
+        JournalRecord *rec = &j->map[j->pos];
+        if (!rec->crc || rec->crc != journal_crc (rec)) break;
+
+        rec = mem_dup (MEM_TRACKING, rec, sizeof (JournalRecord));
+        rec->id[sizeof (rec->id) - 1] = 0;
+        g_hash_table_replace (j->state, rec->id, rec);
+        if (rec->seq > j->seq) j->seq = rec->seq;
+    }
+    DEBUG ("Journal replayed %u records in %" G_GINT64_FORMAT " us", j->pos, g_get_monotonic_time () - start);
+    return j;
+}
+
+static void journal_close (Journal *j)
+{
+    if (j->cancel)
+    {
+        g_cancellable_cancel (j->cancel);
+        g_object_unref (j->cancel);
+    }
+    if (j->map) munmap (j->map, JOURNAL_SLOTS * sizeof (JournalRecord));
+    g_hash_table_destroy (j->state);
+    g_free (j->path);
+    g_free (j);
+}
+
+static void journal_append (Journal *j, JournalRecord *rec)
+{
+    JournalRecord *slot;
+
+    if (!j->map) return;
+    if (j->pos >= JOURNAL_COMPACT_AT) journal_compact (j);
+
+    /* if the journal fills before compaction finishes, the record is written afterwards */
+    if (j->pos >= JOURNAL_SLOTS) return;
+
+    /* plain stores into a tmpfs-backed mapping - nothing here can block; the
+     * checksum goes in last so a crash part way through leaves the slot invalid */
+    slot = &j->map[j->pos++];
+    memcpy (&slot->seq, &rec->seq, sizeof (JournalRecord) - sizeof (rec->crc));
+    __atomic_store_n (&slot->crc, rec->crc, __ATOMIC_RELEASE);
+}
+
+static void journal_write (EjecterPlugin *ej, GDrive *drv, JournalState state, const DevStats *st)
+{
+    Journal *j = ej->journal;
+    JournalRecord *rec;
+    const char *id;
+
+    if (!j || !(id = get_stable_id (ej, drv))) return;
+
+    rec = g_hash_table_lookup (j->state, id);
+    if (!rec)
+    {
+        rec = mem_new0 (JournalRecord, MEM_TRACKING);
+        g_strlcpy (rec->id, id, sizeof (rec->id));
+        g_hash_table_insert (j->state, rec->id, rec);
+    }
+    if (state != JS_NONE) rec->state = state;
+    if (st)
+    {
+        rec->ejects = st->ejects;
+        rec->failures = st->failures;
+        rec->last_total = st->last.total;
+    }
+    rec->seq = ++j->seq;
+    rec->crc = journal_crc (rec);
+    journal_append (j, rec);
+}
+
+/* Write the latest record for each device to a new file on a worker thread,
+ * then switch over to it when that completes */
+
+static void journal_compact (Journal *j)
+{
+    JournalSnapshot *snap;
+    GHashTableIter iter;
+    gpointer val;
+    GTask *task;
+
+    if (j->cancel) return;
+    journal_prune (j);
+
+    snap = mem_new0 (JournalSnapshot, MEM_ASYNC);
+    snap->path = g_strdup_printf ("%s.new", j->path);
+    snap->records = g_byte_array_new ();
+    g_hash_table_iter_init (&iter, j->state);
+    while (g_hash_table_iter_next (&iter, NULL, &val))
+        g_byte_array_append (snap->records, (guint8 *) val, sizeof (JournalRecord));
+    snap->count = snap->records->len / sizeof (JournalRecord);
+    j->compact_seq = j->seq;
+
+    j->cancel = g_cancellable_new ();
+    task = g_task_new (NULL, j->cancel, journal_compact_done, j);
+    g_task_set_check_cancellable (task, FALSE);
+    g_task_set_task_data (task, snap, free_journal_snapshot);
+    g_task_run_in_thread (task, journal_compact_thread);
+    g_object_unref (task);
+}
+
+/* Removed devices first, then oldest first */
+
+static gint journal_prune_order (gconstpointer a, gconstpointer b)
+{
+    const JournalRecord *ra = *(JournalRecord * const *) a, *rb = *(JournalRecord * const *) b;
+
+    if ((ra->state == JS_REMOVED) != (rb->state == JS_REMOVED)) return ra->state == JS_REMOVED ? -1 : 1;
+    return ra->seq < rb->seq ? -1 : ra->seq > rb->seq;
+}
+
+/* Forget the least useful devices once there are more than the compacted
+ * file should hold, so that it always comes out well short of the point
+ * at which the next compaction starts */
+
+static void journal_prune (Journal *j)
+{
+    GPtrArray *recs;
+    GHashTableIter iter;
+    gpointer val;
+    guint i, excess;
+
+    if (g_hash_table_size (j->state) <= JOURNAL_KEEP) return;
+    excess = g_hash_table_size (j->state) - JOURNAL_KEEP;
+
+    recs = g_ptr_array_sized_new (g_hash_table_size (j->state));
+    g_hash_table_iter_init (&iter, j->state);
+    while (g_hash_table_iter_next (&iter, NULL, &val)) g_ptr_array_add (recs, val);
+    g_ptr_array_sort (recs, journal_prune_order);
+
+    DEBUG ("Journal dropping %u of %u devices", excess, recs->len);
+    for (i = 0; i < excess; i++)
+        g_hash_table_remove (j->state, ((JournalRecord *) g_ptr_array_index (recs, i))->id);
+    g_ptr_array_free (recs, TRUE);
+}
+
+static void journal_compact_thread (GTask *task, gpointer, gpointer data, GCancellable *)
+{
+    JournalSnapshot *snap = (JournalSnapshot *) data;
+    GError *err = NULL;
+
+    /* the zero padding up to the full size comes from journal_map */
+    if (!g_file_set_contents (snap->path, (char *) snap->records->data, snap->records->len, &err))
+        g_task_return_error (task, err);
+    else
+        g_task_return_pointer (task, g_strdup (snap->path), g_free);
+}
+
+static void free_journal_snapshot (gpointer data)
+{
+    JournalSnapshot *snap = (JournalSnapshot *) data;
+    g_byte_array_unref (snap->records);
+    g_free (snap->path);
+    mem_free (snap);
+}
+
+static void journal_compact_done (GObject *, GAsyncResult *res, gpointer data)
+{
+    WATCHDOG ("journal", NULL);
+    GTask *task = G_TASK (res);
+    JournalSnapshot *snap = (JournalSnapshot *) g_task_get_task_data (task);
+    GHashTableIter iter;
+    JournalRecord *map;
+    GArray *later;
+    gpointer val;
+    char *tmp;
+    guint i;
+
+    /* the plugin has gone, and the journal with it - just clear up the new file */
+    tmp = g_task_propagate_pointer (task, NULL);
+    if (g_cancellable_is_cancelled (g_task_get_cancellable (task)))
+    {
+        if (tmp) unlink (tmp);
+        g_free (tmp);
+        return;
+    }
+
+    Journal *j = (Journal *) data;
+    g_clear_object (&j->cancel);
+
+    if (!tmp || rename (tmp, j->path) < 0 || !(map = journal_map (j->path)))
+    {
+        DEBUG ("Journal compaction failed");
+        if (tmp) unlink (tmp);
+        g_free (tmp);
+        return;
+    }
+    g_free (tmp);
+
+    munmap (j->map, JOURNAL_SLOTS * sizeof (JournalRecord));
+    j->map = map;
+    j->pos = snap->count;
+
+    /* anything written since the snapshot went to the old file - copied out
+     * first, as appending can start another compaction and prune the table */
+    later = g_array_new (FALSE, FALSE, sizeof (JournalRecord));
+    g_hash_table_iter_init (&iter, j->state);
+    while (g_hash_table_iter_next (&iter, NULL, &val))
+        if (((JournalRecord *) val)->seq > j->compact_seq) g_array_append_vals (later, val, 1);
+    for (i = 0; i < later->len; i++) journal_append (j, &g_array_index (later, JournalRecord, i));
+    g_array_free (later, TRUE);
+}
+
+/* Reconcile the journal with the drives connected now */
+
+static void journal_restore (EjecterPlugin *ej)
+{
+    GHashTable *present = g_hash_table_new (g_str_hash, g_str_equal);
+    GList *l, *drives = g_volume_monitor_get_connected_drives (ej->monitor);
+    GArray *removed = g_array_new (FALSE, FALSE, sizeof (JournalRecord));
+    GHashTableIter iter;
+    gpointer key, val;
+    guint i;
+
+    for (l = drives; l != NULL; l = l->next)
+    {
+        const char *id = get_stable_id (ej, (GDrive *) l->data);
+        if (id) g_hash_table_insert (present, (gpointer) id, l->data);
+    }
+
+    g_hash_table_iter_init (&iter, ej->journal->state);
+    while (g_hash_table_iter_next (&iter, &key, &val))
+    {
+        JournalRecord *rec = (JournalRecord *) val;
+        GDrive *drv = g_hash_table_lookup (present, key);
+
+        if (drv)
+        {
+            /* ejected before the restart and still plugged in - removing it is fine */
+            if (rec->state == JS_EJECTED && !is_drive_mounted (drv))
+            {
+                EjectList *el = mem_new0 (EjectList, MEM_TRACKING);
+                el->drv = drv;
+                el->seq = -1;
+                ej->ejdrives = mem_list_append (MEM_TRACKING, ej->ejdrives, el);
+            }
+
+            char *dev = g_drive_get_identifier (drv, G_DRIVE_IDENTIFIER_KIND_UNIX_DEVICE);
+            if (dev && (rec->ejects || rec->failures))
+            {
+                DevStats *st = mem_new0 (DevStats, MEM_TRACKING);
+                st->ejects = rec->ejects;
+                st->failures = rec->failures;
+                st->last.total = rec->last_total;
+                st->max_total = rec->last_total;
+                g_hash_table_replace (ej->stats, mem_take_str (MEM_TRACKING, dev), st);
+            }
+            else g_free (dev);
+        }
+        else if (rec->state == JS_MOUNTED)
+        {
+            /* still mounted when the panel went down, and gone now */
+            DEBUG ("DRIVE %s REMOVED DURING RESTART", rec->id);
+            wrap_notify (ej->panel, _("Drive was removed without ejecting\nPlease use menu to eject before removal"));
+            rec->state = JS_REMOVED;
+            rec->seq = ++ej->journal->seq;
+            rec->crc = journal_crc (rec);
+            g_array_append_vals (removed, rec, 1);
+        }
+    }
+
+    /* not while walking the table - appending can compact, which prunes it */
+    for (i = 0; i < removed->len; i++) journal_append (ej->journal, &g_array_index (removed, JournalRecord, i));
+    g_array_free (removed, TRUE);
+
+    g_hash_table_destroy (present);
+    g_list_free_full (drives, g_object_unref);
+}
+
+/* Suspend and shutdown */
+
+static void inhibit_init (EjecterPlugin *ej)
+{
+    Inhibitor *ih = g_new0 (Inhibitor, 1);
+    const char *addr = g_getenv ("EJECTER_LOGIND_BUS");
+
+    ih->cancel = g_cancellable_new ();
+    ih->fd = -1;
+    ej->inhibitor = ih;
+
+    /* a private bus address lets this be run against a mock logind */
+    if (addr)
+        g_dbus_connection_new_for_address (addr, G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT |
+            G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION, NULL, ih->cancel, inhibit_connected, ej);
+    else
+        g_bus_get (G_BUS_TYPE_SYSTEM, ih->cancel, inhibit_connected, ej);
+}
+
+static void inhibit_connected (GObject *, GAsyncResult *res, gpointer data)
+{
+    WATCHDOG ("logind", NULL);
+    EjecterPlugin *ej = (EjecterPlugin *) data;
+    GDBusConnection *bus;
+    GError *err = NULL;
+
+    bus = g_getenv ("EJECTER_LOGIND_BUS") ? g_dbus_connection_new_for_address_finish (res, &err) : g_bus_get_finish (res, &err);
+    if (!bus)
+    {
+        if (!g_error_matches (err, G_IO_ERROR, G_IO_ERROR_CANCELLED)) DEBUG ("No logind bus %s", err->message);
+        g_error_free (err);
+        return;
+    }
+
+    Inhibitor *ih = ej->inhibitor;
+    ih->bus = bus;
+    ih->sleep_sub = g_dbus_connection_signal_subscribe (bus, LOGIND_NAME, LOGIND_IFACE, "PrepareForSleep",
+        LOGIND_PATH, NULL, G_DBUS_SIGNAL_FLAGS_NONE, inhibit_signal, ej, NULL);
+    ih->shutdown_sub = g_dbus_connection_signal_subscribe (bus, LOGIND_NAME, LOGIND_IFACE, "PrepareForShutdown",
+        LOGIND_PATH, NULL, G_DBUS_SIGNAL_FLAGS_NONE, inhibit_signal, ej, NULL);
+    inhibit_take (ej);
+}
+
+static void inhibit_take (EjecterPlugin *ej)
+{
+    Inhibitor *ih = ej->inhibitor;
+
+    if (ih->fd >= 0) return;
+    g_dbus_connection_call_with_unix_fd_list (ih->bus, LOGIND_NAME, LOGIND_PATH, LOGIND_IFACE, "Inhibit",
+        g_variant_new ("(ssss)", "sleep:shutdown", PLUGIN_TITLE, "Flushing removable drives", "delay"),
+        G_VARIANT_TYPE ("(h)"), G_DBUS_CALL_FLAGS_NONE, -1, NULL, ih->cancel, inhibit_taken, ej);
+}
+
+static void inhibit_taken (GObject *source_object, GAsyncResult *res, gpointer data)
+{
+    WATCHDOG ("logind", NULL);
+    EjecterPlugin *ej = (EjecterPlugin *) data;
+    GUnixFDList *fds = NULL;
+    GError *err = NULL;
+    GVariant *ret;
+    gint32 idx;
+
+    ret = g_dbus_connection_call_with_unix_fd_list_finish (G_DBUS_CONNECTION (source_object), &fds, res, &err);
+    if (!ret)
+    {
+        if (!g_error_matches (err, G_IO_ERROR, G_IO_ERROR_CANCELLED)) DEBUG ("Inhibit failed %s", err->message);
+        g_error_free (err);
+        return;
+    }
+
+    g_variant_get (ret, "(h)", &idx);
+    if (ej->inhibitor->fd < 0) ej->inhibitor->fd = g_unix_fd_list_get (fds, idx, NULL);
+    DEBUG ("Holding sleep and shutdown delay lock");
+    g_variant_unref (ret);
+    g_object_unref (fds);
+}
+
+static void inhibit_release (EjecterPlugin *ej)
+{
+    Inhibitor *ih = ej->inhibitor;
+
+    if (ih->deadline) g_source_remove (ih->deadline);
+    ih->deadline = 0;
+    if (ih->fd >= 0)
+    {
+        DEBUG ("Releasing sleep and shutdown delay lock");
+        close (ih->fd);
+        ih->fd = -1;
+    }
+}
+
+static void inhibit_signal (GDBusConnection *, const char *, const char *, const char *, const char *signal, GVariant *params, gpointer data)
+{
+    WATCHDOG ("logind", NULL);
+    EjecterPlugin *ej = (EjecterPlugin *) data;
+    gboolean start;
+
+    g_variant_get (params, "(b)", &start);
+    DEBUG ("%s %d", signal, start);
+
+    /* on resume, or a cancelled shutdown, be ready for the next one */
+    if (start) flush_all (ej);
+    else inhibit_take (ej);
+}
+
+static void inhibit_close (Inhibitor *ih)
+{
+    g_cancellable_cancel (ih->cancel);
+    g_object_unref (ih->cancel);
+    if (ih->deadline) g_source_remove (ih->deadline);
+    if (ih->fd >= 0) close (ih->fd);
+    if (ih->bus)
+    {
+        g_dbus_connection_signal_unsubscribe (ih->bus, ih->sleep_sub);
+        g_dbus_connection_signal_unsubscribe (ih->bus, ih->shutdown_sub);
+        g_object_unref (ih->bus);
+    }
+    g_free (ih);
+}
+
+/* Flush and unmount everything that was mounted, all at once, then let the
+ * system go - whether or not they have all finished by the deadline */
+
+static void flush_all (EjecterPlugin *ej)
+{
+    Inhibitor *ih = ej->inhibitor;
+    GList *l, *m, *mnts, *tasks = NULL;
+    GThreadPool *pool;
+
+    /* start a new round even if the last one is still stuck - the lock is
+     * held again by now, and only this round's operations may release it */
+    if (ih->deadline) g_source_remove (ih->deadline);
+    ih->deadline = 0;
+    ih->round++;
+    ih->pending = 0;
+    prefetch_cancel_all (ej);
+
+    for (l = ej->mdrives; l != NULL; l = l->next)
+    {
+        mnts = eject_get_mounts ((GDrive *) l->data);
+        for (m = mnts; m != NULL; m = m->next)
+        {
+            FlushOp *op = mem_new0 (FlushOp, MEM_ASYNC);
+            op->ej = ej;
+            op->cancel = g_object_ref (ih->cancel);
+            op->drv = g_object_ref (l->data);
+            op->mnt = g_object_ref (m->data);
+            op->start = g_get_monotonic_time ();
+            op->round = ih->round;
+            ih->pending++;
+
+            GTask *task = g_task_new (NULL, op->cancel, flush_synced, op);
+            g_task_set_task_data (task, eject_get_mount_path (op->mnt), g_free);
+            tasks = g_list_prepend (tasks, task);
+        }
+        g_list_free_full (mnts, g_object_unref);
+    }
+
+    /* a thread of its own for each mount, all started at once - the pool
+     * GTask uses grows slowly, and prefetches share it; the pool goes once
+     * the last flush has been handed back */
+    if (tasks)
+    {
+        pool = g_thread_pool_new (flush_thread, NULL, g_list_length (tasks), TRUE, NULL);
+        for (l = tasks; l != NULL; l = l->next) g_thread_pool_push (pool, l->data, NULL);
+        g_thread_pool_free (pool, FALSE, FALSE);
+        g_list_free (tasks);
+    }
+
+    if (ih->pending) ih->deadline = g_timeout_add (FLUSH_DEADLINE_MS, flush_deadline, ej);
+    else inhibit_release (ej);
+    act_kick (ej);
+}
+
+static gboolean flush_deadline (gpointer data)
+{
+    WATCHDOG ("timer", NULL);
+    EjecterPlugin *ej = (EjecterPlugin *) data;
+
+    DEBUG ("Flush deadline passed with %d mounts outstanding", ej->inhibitor->pending);
+    ej->inhibitor->deadline = 0;
+
+    /* whatever is still outstanding must not release the lock taken on resume */
+    ej->inhibitor->round++;
+    ej->inhibitor->pending = 0;
+    inhibit_release (ej);
+    return FALSE;
+}
+
+static void flush_thread (gpointer data, gpointer)
+{
+    GTask *task = G_TASK (data);
+    int fd = open ((char *) g_task_get_task_data (task), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    /* sync just this filesystem, so one slow drive doesn't hold up the others */
+    if (fd >= 0)
+    {
+        syncfs (fd);
+        close (fd);
+    }
+    g_task_return_boolean (task, TRUE);
+    g_object_unref (task);
+}
+
+static void flush_synced (GObject *, GAsyncResult *, gpointer data)
+{
+    WATCHDOG ("flush", ((FlushOp *) data)->drv);
+    FlushOp *op = (FlushOp *) data;
+
+    if (g_cancellable_is_cancelled (op->cancel))
+    {
+        flush_op_done (op);
+        return;
+    }
+
+    char *id = g_drive_get_identifier (op->drv, G_DRIVE_IDENTIFIER_KIND_UNIX_DEVICE);
+    if (id)
+    {
+        DevStats *st = g_hash_table_lookup (op->ej->stats, id);
+        if (!st)
+        {
+            st = mem_new0 (DevStats, MEM_TRACKING);
+            g_hash_table_insert (op->ej->stats, mem_strdup (MEM_TRACKING, id), st);
+        }
+        st->flush = g_get_monotonic_time () - op->start;
+        DEBUG ("FLUSHED %s in %" G_GINT64_FORMAT " ms", id, st->flush / 1000);
+        g_free (id);
+    }
+
+    prefetch_wait (op->ej, NULL, op->mnt, flush_unmount, op);
+}
+
+static void flush_unmount (gpointer data)
+{
+    FlushOp *op = (FlushOp *) data;
+
+    if (g_cancellable_is_cancelled (op->cancel)) flush_op_done (op);
+    else g_mount_unmount_with_operation (op->mnt, G_MOUNT_UNMOUNT_NONE, NULL, op->cancel, flush_unmounted, op);
+}
+
+static void flush_unmounted (GObject *source_object, GAsyncResult *res, gpointer data)
+{
+    WATCHDOG ("flush", source_object);
+    GError *err = NULL;
+
+    if (!g_mount_unmount_with_operation_finish (G_MOUNT (source_object), res, &err))
+    {
+        DEBUG ("UNMOUNT BEFORE SLEEP FAILED %s", err->message);
+        g_error_free (err);
+    }
+    flush_op_done ((FlushOp *) data);
+}
+
+static void flush_op_done (FlushOp *op)
+{
+    if (!g_cancellable_is_cancelled (op->cancel))
+    {
+        Inhibitor *ih = op->ej->inhibitor;
+        if (op->round == ih->round && --ih->pending == 0) inhibit_release (op->ej);
+    }
+
+    g_object_unref (op->cancel);
+    g_object_unref (op->mnt);
+    g_object_unref (op->drv);
+    mem_free (op);
+}
+
+/* Ejecter functions */
+
+static gboolean is_drive_mounted (GDrive *d)
+{
+    GList *viter, *vols = g_drive_get_volumes (d);
+    gboolean res = FALSE;
+
+    for (viter = vols; viter != NULL; viter = g_list_next (viter))
+    {
+        GMount *mnt = g_volume_get_mount ((GVolume *) viter->data);
+        if (mnt != NULL)
+        {
+            res = TRUE;
+            g_object_unref (mnt);
+        }
+    }
+    g_list_free_full (vols, g_object_unref);
+    return res;
+}
+
+/* Recheck just the drive an event was for, if any, then show the icon if
+ * any drive has something mounted */
+
+static void update_icon (EjecterPlugin *ej, GDrive *drv)
+{
+    if (drv)
+    {
+        if (is_drive_mounted (drv)) g_hash_table_add (ej->mounted, g_object_ref (drv));
+        else g_hash_table_remove (ej->mounted, drv);
+    }
+    ej->visible = !ej->autohide || g_hash_table_size (ej->mounted);
+
+    if (ej->changed) ej->changed (EJECTER_CHANGED_DRIVES, ej->changed_data);
+    else if (ej->visible)
+    {
+        gtk_widget_show_all (ej->plugin);
+        gtk_widget_set_sensitive (ej->plugin, TRUE);
+    }
+    else
+    {
+        gtk_widget_hide (ej->plugin);
+        gtk_widget_set_sensitive (ej->plugin, FALSE);
+    }
+
+    act_kick (ej);
+}
+
+static void show_menu (EjecterPlugin *ej)
+{
+    GList *driter, *mounted, *batch = NULL;
+    int count;
+
+    hide_menu (ej);
+
+    ej->menu = gtk_menu_new ();
+    gtk_menu_set_reserve_toggle_size (GTK_MENU (ej->menu), FALSE);
+
+    /* the drives with something mounted are kept up to date from events */
+    mounted = g_hash_table_get_keys (ej->mounted);
+    count = g_list_length (mounted);
+
+    if (count <= MENU_GROUP_MIN)
+    {
+        /* few enough to list directly */
+        for (driter = mounted; driter != NULL; driter = g_list_next (driter))
+            add_drive_item (ej, ej->menu, (GDrive *) driter->data, &batch);
+    }
+    else
+    {
+        /* one submenu per hub, only filled in when it is opened */
+        GHashTable *groups = g_hash_table_new (g_str_hash, g_str_equal);
+        GList *keys, *l;
+
+        for (driter = mounted; driter != NULL; driter = g_list_next (driter))
+        {
+            const char *name = drive_group (ej, (GDrive *) driter->data);
+            MenuGroup *grp = g_hash_table_lookup (groups, name);
+            if (!grp)
+            {
+                grp = mem_new0 (MenuGroup, MEM_MENU);
+                grp->ej = ej;
+                grp->name = mem_strdup (MEM_MENU, name);
+                g_hash_table_insert (groups, grp->name, grp);
+            }
+            grp->drives = mem_list_append (MEM_MENU, grp->drives, g_object_ref (driter->data));
+        }
+
+        keys = g_list_sort (g_hash_table_get_keys (groups), (GCompareFunc) g_strcmp0);
+        for (l = keys; l != NULL; l = l->next)
+            add_group_item (ej, (MenuGroup *) g_hash_table_lookup (groups, l->data));
+        g_list_free (keys);
+        g_hash_table_destroy (groups);
+    }
+    g_list_free (mounted);
+
+    /* show whatever usage is cached, then refresh any stale entries in one go */
+    update_menu_labels (ej);
+    fs_query_mounts (ej, batch);
+    g_list_free_full (batch, g_object_unref);
+
+    if (count)
+    {
+        g_signal_connect_swapped (ej->menu, "hide", G_CALLBACK (io_monitor_stop), ej);
+        gtk_widget_show_all (ej->menu);
+        wrap_show_menu (ej->plugin, ej->menu);
+        io_monitor_start (ej);
+    }
+    else io_monitor_stop (ej);
+}
+
+static void add_drive_item (EjecterPlugin *ej, GtkWidget *menu, GDrive *drv, GList **batch)
+{
+    GtkWidget *item = create_menuitem (ej, drv);
+    GList *miter, *mnts;
+
+    CallbackData *dt = mem_new0 (CallbackData, MEM_MENU);
+    dt->ej = ej;
+    dt->drv = drv;
+    g_signal_connect_data (item, "activate", G_CALLBACK (handle_eject_clicked), dt, free_callback_data, 0);
+    gtk_menu_shell_append (GTK_MENU_SHELL (menu), item);
+
+    /* note the label and block device so the item can show live throughput */
+    MenuEntry *me = mem_new0 (MenuEntry, MEM_MENU);
+    me->label = find_menu_label (item);
+    if (me->label) me->text = g_strdup (gtk_label_get_text (GTK_LABEL (me->label)));
+    char *dev = eject_get_devname (drv);
+    if (dev)
+    {
+        me->io = g_hash_table_lookup (ej->iostats, dev);
+        if (!me->io)
+        {
+            me->io = mem_new0 (IoStat, MEM_TRACKING);
+            g_strlcpy (me->io->dev, dev, sizeof (me->io->dev));
+            g_hash_table_insert (ej->iostats, me->io->dev, me->io);
+        }
+        g_free (dev);
+    }
+    mnts = eject_get_mounts (drv);
+    for (miter = mnts; miter != NULL; miter = g_list_next (miter))
+        me->paths = g_list_append (me->paths, eject_get_mount_path ((GMount *) miter->data));
+    *batch = g_list_concat (*batch, mnts);
+    ej->menu_items = mem_list_append (MEM_MENU, ej->menu_items, me);
+}
+
+/* Name the hub a drive is plugged into, from its path in sysfs - for example
+ * .../usb1/1-1/1-1.3/1-1.3:1.0/host0/... is port 3 of hub 1-1 */
+
+static char *get_drive_group (GDrive *d)
+{
+    char *dev, *path, *real, *port = NULL, *hub, **parts, **part;
+
+    dev = eject_get_devname (d);
+    if (!dev) return g_strdup (_("Other drives"));
+    path = g_strdup_printf ("%s/sys/block/%s", eject_sysfs_root (), dev);
+    real = realpath (path, NULL);
+    g_free (path);
+    g_free (dev);
+    if (!real) return g_strdup (_("Other drives"));
+
+    parts = g_strsplit (real, "/", -1);
+    for (part = parts; *part; part++)
+        if (g_ascii_isdigit (**part) && strchr (*part, '-') && strspn (*part, "0123456789-.") == strlen (*part)) port = *part;
+
+    if (!port) hub = g_strdup (_("Other drives"));
+    else if (strchr (port, '.'))
+    {
+        *strrchr (port, '.') = 0;
+        hub = g_strdup_printf (_("USB hub %s"), port);
     }
     else
     {
-        DEBUG ("VOL EJECT FAILED");
-        buffer = g_strdup_printf (_("Failed to eject %s\n%s"), name, err->message);
-        wrap_notify (ej->panel, buffer);
+        *strchr (port, '-') = 0;
+        hub = g_strdup_printf (_("USB bus %s"), port);
+    }
+
+    g_strfreev (parts);
+    free (real);
+    return hub;
+}
+
+/* The hub name for a drive, read from sysfs once and kept until it goes */
+
+static const char *drive_group (EjecterPlugin *ej, GDrive *d)
+{
+    char *name = g_hash_table_lookup (ej->drive_groups, d);
+
+    if (!name)
+    {
+        name = mem_take_str (MEM_TRACKING, get_drive_group (d));
+        g_hash_table_insert (ej->drive_groups, g_object_ref (d), name);
+    }
+    return name;
+}
+
+static void add_group_item (EjecterPlugin *ej, MenuGroup *grp)
+{
+    char *text = g_strdup_printf (ngettext ("%s (%d drive)", "%s (%d drives)", g_list_length (grp->drives)),
+        grp->name, g_list_length (grp->drives));
+    GtkWidget *item = wrap_new_menu_item (ej, text, 40, NULL);
+    g_free (text);
+
+    /* an empty submenu, so GTK shows it as one, filled in when first selected */
+    grp->submenu = gtk_menu_new ();
+    gtk_menu_set_reserve_toggle_size (GTK_MENU (grp->submenu), FALSE);
+    gtk_menu_item_set_submenu (GTK_MENU_ITEM (item), grp->submenu);
+    g_signal_connect_data (item, "select", G_CALLBACK (populate_group), grp, free_menu_group, 0);
+    gtk_menu_shell_append (GTK_MENU_SHELL (ej->menu), item);
+}
+
+static void populate_group (GtkWidget *, gpointer data)
+{
+    WATCHDOG ("menu", ((MenuGroup *) data)->drives ? ((MenuGroup *) data)->drives->data : NULL);
+    MenuGroup *grp = (MenuGroup *) data;
+    EjecterPlugin *ej = grp->ej;
+    GList *l, *batch = NULL, *children;
+    GtkWidget *item;
+
+    children = gtk_container_get_children (GTK_CONTAINER (grp->submenu));
+    g_list_free (children);
+    if (children) return;
+
+    item = wrap_new_menu_item (ej, _("Eject all drives on this hub"), 40, "media-eject");
+    g_signal_connect (item, "activate", G_CALLBACK (handle_eject_group), grp);
+    gtk_menu_shell_append (GTK_MENU_SHELL (grp->submenu), item);
+    gtk_menu_shell_append (GTK_MENU_SHELL (grp->submenu), gtk_separator_menu_item_new ());
+
+    for (l = grp->drives; l != NULL; l = l->next)
+        add_drive_item (ej, grp->submenu, (GDrive *) l->data, &batch);
+
+    update_menu_labels (ej);
+    fs_query_mounts (ej, batch);
+    g_list_free_full (batch, g_object_unref);
+    gtk_widget_show_all (grp->submenu);
+}
+
+static void handle_eject_group (GtkWidget *, gpointer data)
+{
+    WATCHDOG ("menu", ((MenuGroup *) data)->drives ? ((MenuGroup *) data)->drives->data : NULL);
+    MenuGroup *grp = (MenuGroup *) data;
+    GList *l;
+
+    for (l = grp->drives; l != NULL; l = l->next)
+        eject_drive (grp->ej, (GDrive *) l->data, VERB_AUTO);
+}
+
+static void free_menu_group (gpointer data, GClosure *)
+{
+    MenuGroup *grp = (MenuGroup *) data;
+    mem_list_free (MEM_MENU, grp->drives, g_object_unref);
+    mem_free (grp->name);
+    mem_free (grp);
+}
+
+static void free_callback_data (gpointer data, GClosure *)
+{
+    mem_free (data);
+}
+
+static void hide_menu (EjecterPlugin *ej)
+{
+    if (ej->menu)
+    {
+        gtk_menu_popdown (GTK_MENU (ej->menu));
+        gtk_widget_destroy (ej->menu);
+        ej->menu = NULL;
+    }
+    io_monitor_stop (ej);
+}
+
+static GtkWidget *create_menuitem (EjecterPlugin *ej, GDrive *d)
+{
+    char buffer[1024], *name, *vname;
+    GList *vols, *iter;
+    GVolume *v;
+    GIcon *ic = NULL;
+    GtkWidget *item, *icon, *eject;
+
+    vols = g_drive_get_volumes (d);
+    name = g_drive_get_name (d);
+
+    sprintf (buffer, "%s (", name);
+    gboolean first = TRUE;
+    for (iter = vols; iter != NULL; iter = g_list_next (iter))
+    {
+        v = (GVolume *) iter->data;
+        vname = g_volume_get_name (v);
+        if (vname)
+        {
+            if (first)
+            {
+                ic = g_volume_get_icon (v);
+                first = FALSE;
+            }
+            else strcat (buffer, ", ");
+            strcat (buffer, vname);
+            g_free (vname);
+        }
     }
+    g_list_free_full (vols, g_object_unref);
+
+    strcat (buffer, ")");
     g_free (name);
-    g_free (buffer);
-    g_free (dt);
+
+    if (!ic) ic = g_drive_get_icon (d);
+    icon = gtk_image_new_from_gicon (ic, wrap_icon_size (ej) >= 32 ? GTK_ICON_SIZE_LARGE_TOOLBAR : GTK_ICON_SIZE_BUTTON);
+    g_object_unref (ic);
+
+    item = wrap_new_menu_item (ej, buffer, 40, NULL);
+    lxpanel_plugin_update_menu_icon (item, icon);
+
+    eject = gtk_image_new ();
+    wrap_set_menu_icon (ej, eject, "media-eject");
+    lxpanel_plugin_append_menu_icon (item, eject);
+
+    gtk_widget_show_all (item);
+
+    return item;
+}
+
+static GtkWidget *find_menu_label (GtkWidget *widget)
+{
+    GList *children, *iter;
+    GtkWidget *label = NULL;
+
+    if (GTK_IS_LABEL (widget)) return widget;
+    if (!GTK_IS_CONTAINER (widget)) return NULL;
+
+    children = gtk_container_get_children (GTK_CONTAINER (widget));
+    for (iter = children; iter != NULL && !label; iter = g_list_next (iter))
+        label = find_menu_label (GTK_WIDGET (iter->data));
+    g_list_free (children);
+    return label;
+}
+
+static void free_menu_entry (gpointer data)
+{
+    MenuEntry *me = (MenuEntry *) data;
+    g_list_free_full (me->paths, g_free);
+    g_free (me->text);
+    mem_free (me);
+}
+
+/* I/O statistics */
+
+static gboolean read_io_sample (const char *dev, IoSample *s)
+{
+    char path[PATH_MAX], buffer[256];
+    ssize_t len;
+    int fd;
+
+    /* deliberately avoids GIO - this runs for every drive on every tick */
+    snprintf (path, sizeof (path), "%s/sys/block/%s/stat", eject_sysfs_root (), dev);
+    fd = open (path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return FALSE;
+    len = read (fd, buffer, sizeof (buffer) - 1);
+    close (fd);
+    if (len <= 0) return FALSE;
+    buffer[len] = 0;
+
+    /* fields are reads, merged, sectors, ms, writes, merged, sectors, ms, in flight, ... */
+    if (sscanf (buffer, "%*u %*u %" G_GUINT64_FORMAT " %*u %*u %*u %" G_GUINT64_FORMAT " %*u %u",
+        &s->rd_sectors, &s->wr_sectors, &s->inflight) != 3) return FALSE;
+    s->time = g_get_monotonic_time ();
+    return TRUE;
+}
+
+static void io_sample_all (EjecterPlugin *ej)
+{
+    GHashTableIter iter;
+    gpointer val;
+
+    /* one pass over every device in the open menu */
+    g_hash_table_iter_init (&iter, ej->iostats);
+    while (g_hash_table_iter_next (&iter, NULL, &val))
+    {
+        IoStat *io = (IoStat *) val;
+        int next = (io->head + 1) % IO_RING_LEN;
+        if (!read_io_sample (io->dev, &io->ring[next])) continue;
+        io->head = next;
+        if (io->count < IO_RING_LEN) io->count++;
+    }
+}
+
+static void io_format (IoStat *io, GString *str)
+{
+    IoSample *new, *old;
+    char *rd, *wr;
+    gint64 usecs;
+
+    if (io->count < 2) return;
+
+    /* rates are averaged over the whole ring to smooth out bursty writeback */
+    new = &io->ring[io->head];
+    old = &io->ring[(io->head + IO_RING_LEN - io->count + 1) % IO_RING_LEN];
+    usecs = new->time - old->time;
+    if (usecs <= 0) return;
+
+    rd = g_format_size ((new->rd_sectors - old->rd_sectors) * SECTOR_SIZE * G_USEC_PER_SEC / usecs);
+    wr = g_format_size ((new->wr_sectors - old->wr_sectors) * SECTOR_SIZE * G_USEC_PER_SEC / usecs);
+    g_string_append_c (str, '\n');
+    g_string_append_printf (str, _("Read %s/s, write %s/s, %u in flight"), rd, wr, new->inflight);
+    g_free (rd);
+    g_free (wr);
+}
+
+static gboolean io_tick (gpointer data)
+{
+    WATCHDOG ("timer", NULL);
+    EjecterPlugin *ej = (EjecterPlugin *) data;
+
+    io_sample_all (ej);
+    update_menu_labels (ej);
+    return TRUE;
+}
+
+static void io_monitor_start (EjecterPlugin *ej)
+{
+    if (ej->io_timer) return;
+
+    /* take a baseline now so the first tick already has a rate to show */
+    io_sample_all (ej);
+    ej->io_timer = g_timeout_add (IO_SAMPLE_MS, io_tick, ej);
+}
+
+static void io_monitor_stop (EjecterPlugin *ej)
+{
+    if (ej->io_timer) g_source_remove (ej->io_timer);
+    ej->io_timer = 0;
+
+    mem_list_free (MEM_MENU, ej->menu_items, free_menu_entry);
+    ej->menu_items = NULL;
+    g_hash_table_remove_all (ej->iostats);
+}
+
+/* Filesystem usage */
+
+static void fs_query_mounts (EjecterPlugin *ej, GList *mounts)
+{
+    gint64 now = g_get_monotonic_time ();
+    GList *l;
+
+    /* fire off every query at once - a hung drive must not hold up the rest */
+    for (l = mounts; l != NULL; l = l->next)
+    {
+        GMount *mnt = (GMount *) l->data;
+        char *path = eject_get_mount_path (mnt);
+        FsInfo *fi = g_hash_table_lookup (ej->fsinfo, path);
+
+        if (fi && (fi->pending || (fi->valid && now - fi->time < FS_CACHE_TTL_US)))
+        {
+            g_free (path);
+            continue;
+        }
+        if (!fi)
+        {
+            fi = mem_new0 (FsInfo, MEM_TRACKING);
+            fi->name = mem_take_str (MEM_TRACKING, g_mount_get_name (mnt));
+            g_hash_table_insert (ej->fsinfo, mem_strdup (MEM_TRACKING, path), fi);
+        }
+        fi->pending = TRUE;
+
+        FsQuery *q = mem_new0 (FsQuery, MEM_ASYNC);
+        q->ej = ej;
+        q->cancel = g_object_ref (ej->fs_cancel);
+        q->path = path;
+
+        GFile *root = g_mount_get_root (mnt);
+        g_file_query_filesystem_info_async (root, G_FILE_ATTRIBUTE_FILESYSTEM_SIZE "," G_FILE_ATTRIBUTE_FILESYSTEM_FREE,
+            G_PRIORITY_LOW, q->cancel, fs_query_done, q);
+        g_object_unref (root);
+    }
+}
+
+static void fs_query_done (GObject *source_object, GAsyncResult *res, gpointer data)
+{
+    WATCHDOG ("usage", NULL);
+    FsQuery *q = (FsQuery *) data;
+    GFileInfo *info;
+    GError *err = NULL;
+
+    info = g_file_query_filesystem_info_finish (G_FILE (source_object), res, &err);
+
+    /* the plugin may have gone away - do not touch it once cancelled */
+    if (!g_cancellable_is_cancelled (q->cancel))
+    {
+        FsInfo *fi = g_hash_table_lookup (q->ej->fsinfo, q->path);
+        if (fi)
+        {
+            fi->pending = FALSE;
+            fi->time = g_get_monotonic_time ();
+            if (info)
+            {
+                fi->size = g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_FILESYSTEM_SIZE);
+                fi->free = g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_FILESYSTEM_FREE);
+                fi->valid = fi->size != 0;
+            }
+            else
+            {
+                DEBUG ("USAGE QUERY FAILED %s %s", q->path, err->message);
+                fi->valid = FALSE;
+            }
+            update_menu_labels (q->ej);
+            update_tooltip (q->ej);
+        }
+    }
+
+    if (info) g_object_unref (info);
+    if (err) g_error_free (err);
+    g_object_unref (q->cancel);
+    g_free (q->path);
+    mem_free (q);
+}
+
+static void fs_invalidate (EjecterPlugin *ej, GMount *mount)
+{
+    char *path = eject_get_mount_path (mount);
+    g_hash_table_remove (ej->fsinfo, path);
+    g_free (path);
+}
+
+static void fs_format (EjecterPlugin *ej, GList *paths, GString *str)
+{
+    gboolean first = TRUE;
+    char *fr, *sz;
+    GList *l;
+
+    for (l = paths; l != NULL; l = l->next)
+    {
+        FsInfo *fi = g_hash_table_lookup (ej->fsinfo, (char *) l->data);
+        if (!fi || !fi->valid) continue;
+
+        fr = g_format_size (fi->free);
+        sz = g_format_size (fi->size);
+        g_string_append (str, first ? "\n" : ", ");
+        g_string_append_printf (str, _("%s: %s free of %s"), fi->name, fr, sz);
+        g_free (fr);
+        g_free (sz);
+        first = FALSE;
+    }
+}
+
+static void free_fs_info (gpointer data)
+{
+    FsInfo *fi = (FsInfo *) data;
+    mem_free (fi->name);
+    mem_free (fi);
+}
+
+static void update_tooltip (EjecterPlugin *ej)
+{
+    GString *str = g_string_new (_("Select a drive in menu to eject safely"));
+    GList *l, *paths = g_hash_table_get_keys (ej->fsinfo);
+
+    /* one line per volume, in a stable order */
+    paths = g_list_sort (paths, (GCompareFunc) g_strcmp0);
+    for (l = paths; l != NULL; l = l->next)
+    {
+        GList single = { l->data, NULL, NULL };
+        fs_format (ej, &single, str);
+    }
+    g_list_free (paths);
+
+    gtk_widget_set_tooltip_text (ej->tray_icon, str->str);
+    g_string_free (str, TRUE);
+}
+
+static void update_menu_labels (EjecterPlugin *ej)
+{
+    GList *l;
+
+    for (l = ej->menu_items; l != NULL; l = l->next)
+    {
+        MenuEntry *me = (MenuEntry *) l->data;
+        if (!me->label || !me->text) continue;
+
+        GString *str = g_string_new (me->text);
+        fs_format (ej, me->paths, str);
+        if (me->io) io_format (me->io, str);
+        gtk_label_set_text (GTK_LABEL (me->label), str->str);
+        g_string_free (str, TRUE);
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+/* wf-panel plugin functions                                                  */
+/*----------------------------------------------------------------------------*/
+
+/* Handler for button click */
+static void ejecter_button_clicked (GtkWidget *, EjecterPlugin * ej)
+{
+    WATCHDOG ("menu", NULL);
+    CHECK_LONGPRESS
+    show_menu (ej);
+}
+
+/* Handler for system config changed message from panel */
+void ejecter_update_display (EjecterPlugin * ej)
+{
+    WATCHDOG ("display", NULL);
+    ejecter_update_icon (ej);
+    update_icon (ej, NULL);
+}
+
+/* Reload the icon from the theme, without looking at the drives again */
+
+void ejecter_update_icon (EjecterPlugin *ej)
+{
+    ActState state = ej->act_state;
+
+    wrap_set_taskbar_icon (ej, ej->tray_icon, "plugin-eject");
+    act_set_base (ej);
+    act_show (ej, state);
+}
+
+/* Control message index */
+
+static void index_refresh (EjecterPlugin *ej)
+{
+    if (!ej->index_dirty) return;
+
+    /* the only full enumeration - repeated only after the volume monitor reports a change */
+    g_list_free_full (ej->index_drives, g_object_unref);
+    ej->index_drives = g_volume_monitor_get_connected_drives (ej->monitor);
+    g_hash_table_unref (ej->index);
+    ej->index = eject_index_new (ej->index_drives);
+    ej->index_dirty = FALSE;
+}
+
+static void control_list (EjecterPlugin *ej, GString *reply)
+{
+    GList *driter, *mnts, *miter;
+    const char *state;
+    char *id, *name, *path;
+
+    for (driter = ej->index_drives; driter != NULL; driter = g_list_next (driter))
+    {
+        GDrive *drv = (GDrive *) driter->data;
+        GList *l;
+
+        mnts = eject_get_mounts (drv);
+        state = mnts ? "mounted" : "unmounted";
+        for (l = ej->ejdrives; l != NULL; l = l->next)
+            if (((EjectList *) l->data)->drv == drv) state = "ejected";
+
+        id = g_drive_get_identifier (drv, G_DRIVE_IDENTIFIER_KIND_UNIX_DEVICE);
+        name = g_drive_get_name (drv);
+        g_string_append_printf (reply, "%s\t%s\t%s\t", id ? id : "-", name, state);
+        for (miter = mnts; miter != NULL; miter = g_list_next (miter))
+        {
+            path = eject_get_mount_path ((GMount *) miter->data);
+            g_string_append_printf (reply, "%s%s", miter == mnts ? "" : ",", path);
+            g_free (path);
+        }
+        g_string_append_c (reply, '\n');
+
+        g_list_free_full (mnts, g_object_unref);
+        g_free (name);
+        g_free (id);
+    }
+}
+
+static void control_stalls (GString *reply)
+{
+    GDateTime *dt;
+    char *when;
+    int i;
+
+    /* oldest first - local time, handler, event, device and duration in ms */
+    for (i = 0; i < stall_count; i++)
+    {
+        Stall *st = &stall_ring[(stall_head - stall_count + i + STALL_RING) % STALL_RING];
+        dt = g_date_time_new_from_unix_local (st->when / G_USEC_PER_SEC);
+        when = g_date_time_format (dt, "%F %T");
+        g_string_append_printf (reply, "%s\t%s\t%s\t%s\t%" G_GINT64_FORMAT "\n", when, st->name, st->event, st->dev,
+            st->duration / 1000);
+        g_free (when);
+        g_date_time_unref (dt);
+    }
+}
+
+static void control_memstats (EjecterPlugin *ej, GString *reply)
+{
+    GHashTable *devs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    MemCount total = { 0 };
+    GHashTableIter iter;
+    gpointer key, val;
+    int i;
+
+    /* bytes live and at peak, then block counts, for each subsystem and overall */
+    G_LOCK (mem);
+    for (i = 0; i < MEM_TAGS; i++)
+    {
+        g_string_append_printf (reply, "%s\tlive=%" G_GSIZE_FORMAT "\tpeak=%" G_GSIZE_FORMAT "\tallocs=%u\tfrees=%u\n",
+            mem_tags[i], mem_counts[i].live, mem_counts[i].peak, mem_counts[i].allocs, mem_counts[i].frees);
+        total.live += mem_counts[i].live;
+        total.peak += mem_counts[i].peak;
+        total.allocs += mem_counts[i].allocs;
+        total.frees += mem_counts[i].frees;
+    }
+    G_UNLOCK (mem);
+    g_string_append_printf (reply, "total\tlive=%" G_GSIZE_FORMAT "\tpeak=%" G_GSIZE_FORMAT "\tallocs=%u\tfrees=%u\tbudget=%" G_GSIZE_FORMAT "\n",
+        total.live, total.peak, total.allocs, total.frees, mem_budget);
+
+    /* then what this instance holds for each device in its per-device tables */
+    mem_by_device (devs, ej->iostats, FALSE);
+    mem_by_device (devs, ej->activity, TRUE);
+    mem_by_device (devs, ej->bdi, TRUE);
+    mem_by_device (devs, ej->stats, TRUE);
+    g_hash_table_iter_init (&iter, devs);
+    while (g_hash_table_iter_next (&iter, &key, &val))
+        g_string_append_printf (reply, "device\t%s\tlive=%" G_GSIZE_FORMAT "\n", (char *) key, GPOINTER_TO_SIZE (val));
+    g_hash_table_destroy (devs);
 }
 
-static void vol_unmount_done (GObject *source_object, GAsyncResult *res, gpointer data)
-{
-    CallbackData *dt = (CallbackData *) data;
-    EjecterPlugin *ej = dt->ej;
-    GMount *mnt = (GMount *) source_object;
-    GDrive *drv = dt->drv;
-    char *buffer, *name = g_drive_get_name (drv);
-    GError *err = NULL;
+/* Add up the accounted blocks in a table keyed by device name or path,
+ * including the keys if the table owns them */
 
-    g_mount_unmount_with_operation_finish (mnt, res, &err);
+static void mem_by_device (GHashTable *devs, GHashTable *table, gboolean keys)
+{
+    GHashTableIter iter;
+    gpointer key, val;
+    const char *dev;
+    gsize size;
 
-    if (err == NULL)
+    g_hash_table_iter_init (&iter, table);
+    while (g_hash_table_iter_next (&iter, &key, &val))
     {
-        DEBUG ("VOL UNMOUNT COMPLETE");
-#ifndef LXPLUG
-        g_application_withdraw_notification (g_application_get_default (), name);
-#endif
-        buffer = g_strdup_printf (_("%s has been unmounted\nIt is now safe to remove the device"), name);
-        wrap_notify (ej->panel, buffer);
-        add_seq_for_drive (ej, drv, wrap_notify (ej->panel, buffer));
+        dev = (const char *) key;
+        if (g_str_has_prefix (dev, "/dev/")) dev += 5;
+        size = mem_size (val) + (keys ? mem_size (key) : 0);
+        size += GPOINTER_TO_SIZE (g_hash_table_lookup (devs, dev));
+        g_hash_table_replace (devs, g_strdup (dev), GSIZE_TO_POINTER (size));
     }
-    else
+}
+
+static void control_stats (EjecterPlugin *ej, GString *reply)
+{
+    GHashTableIter iter;
+    gpointer key, val;
+
+    /* times are in ms - last total, unmount, unmap and eject, worst total, then flush before sleep */
+    g_hash_table_iter_init (&iter, ej->stats);
+    while (g_hash_table_iter_next (&iter, &key, &val))
     {
-        DEBUG ("VOL UNMOUNT FAILED");
-        buffer = g_strdup_printf (_("Failed to unmount %s\n%s"), name, err->message);
-        wrap_notify (ej->panel, buffer);
+        DevStats *st = (DevStats *) val;
+        g_string_append_printf (reply, "%s\tejects=%u\tfailures=%u\ttotal=%" G_GINT64_FORMAT "\tunmount=%" G_GINT64_FORMAT
+            "\tunmap=%" G_GINT64_FORMAT "\teject=%" G_GINT64_FORMAT "\tmax=%" G_GINT64_FORMAT "\tflush=%" G_GINT64_FORMAT "\tprofile=%s\n",
+            (char *) key, st->ejects, st->failures, st->last.total / 1000, st->last.unmount / 1000, st->last.unmap / 1000,
+            st->last.eject / 1000, st->max_total / 1000, st->flush / 1000, st->profile[0] ? st->profile : "-");
     }
-    g_free (name);
-    g_free (buffer);
-    g_free (dt);
 }
 
-/* Ejecter functions */
+static void control_reply (GString *reply)
+{
+    char *path = g_build_filename (g_get_user_runtime_dir (), "ejecter.reply", NULL);
 
-static gboolean is_drive_mounted (GDrive *d)
+    /* lxpanelctl and wf-panel give no return channel, so replies go to a file */
+    if (!g_file_set_contents (path, reply->str, reply->len, NULL))
+        DEBUG ("Unable to write reply to %s", path);
+    g_free (path);
+}
+
+/* Handler for control message */
+gboolean ejecter_control_msg (EjecterPlugin *ej, const char *cmd)
 {
-    GList *viter, *vols = g_drive_get_volumes (d);
-    gboolean res = FALSE;
+    WATCHDOG ("control", NULL);
+    EjectVerb verb = VERB_MARK;
+    GString *reply;
+    gboolean res = TRUE;
+    char **argv;
+    int argc, i = 0;
 
-    for (viter = vols; viter != NULL; viter = g_list_next (viter))
+    DEBUG ("Eject command %s\n", cmd);
+
+    /* commands are "[mark|eject|stop|unmount] <device>...", "list", "stats", "memstats" or "stalls"; a bare device is a mark */
+    if (!g_shell_parse_argv (cmd, &argc, &argv, NULL))
     {
-        GMount *mnt = g_volume_get_mount ((GVolume *) viter->data);
-        if (mnt != NULL)
+        argv = g_new0 (char *, 2);
+        argv[0] = g_strdup (cmd);
+        argc = 1;
+    }
+
+    if (!g_strcmp0 (argv[0], "mark")) verb = VERB_MARK, i++;
+    else if (!g_strcmp0 (argv[0], "eject")) verb = VERB_AUTO, i++;
+    else if (!g_strcmp0 (argv[0], "stop")) verb = VERB_STOP, i++;
+    else if (!g_strcmp0 (argv[0], "unmount")) verb = VERB_UNMOUNT, i++;
+
+    index_refresh (ej);
+    reply = g_string_new (NULL);
+
+    if (!g_strcmp0 (argv[0], "list")) control_list (ej, reply);
+    else if (!g_strcmp0 (argv[0], "stats")) control_stats (ej, reply);
+    else if (!g_strcmp0 (argv[0], "memstats")) control_memstats (ej, reply);
+    else if (!g_strcmp0 (argv[0], "stalls")) control_stalls (reply);
+    else for (; i < argc; i++)
+    {
+        GDrive *d = eject_index_lookup (ej->index, argv[i]);
+        if (!d)
         {
-            res = TRUE;
-            g_object_unref (mnt);
+            g_string_append_printf (reply, "%s\terror\tno matching drive\n", argv[i]);
+            res = FALSE;
+            continue;
+        }
+
+        if (verb == VERB_MARK)
+        {
+            DEBUG ("EXTERNAL EJECT %s", g_drive_get_name (d));
+            log_eject (ej, d);
         }
+        else eject_drive (ej, d, verb);
+        g_string_append_printf (reply, "%s\tok\n", argv[i]);
     }
-    g_list_free_full (vols, g_object_unref);
+
+    control_reply (reply);
+    g_string_free (reply, TRUE);
+    g_strfreev (argv);
     return res;
 }
 
-static void update_icon (EjecterPlugin *ej)
+/* Directory prefetch - reads the top of a newly mounted tree into the dentry
+ * and inode caches, so the file manager's first listing is not left waiting
+ * on cold media */
+
+static void prefetch_start (EjecterPlugin *ej, const char *mount_path)
+{
+    Prefetch *p;
+    GTask *task;
+
+    if (!mount_path || g_hash_table_contains (ej->prefetches, mount_path)) return;
+
+    /* owned by the task, so it lasts as long as the worker does */
+    p = mem_new0 (Prefetch, MEM_ASYNC);
+    p->ej = ej;
+    p->path = mem_strdup (MEM_ASYNC, mount_path);
+    p->cancel = g_cancellable_new ();
+    g_hash_table_insert (ej->prefetches, p->path, p);
+
+    task = g_task_new (NULL, p->cancel, prefetch_done, p);
+    g_task_set_task_data (task, p, free_prefetch);
+    g_task_run_in_thread (task, prefetch_thread);
+    g_object_unref (task);
+}
+
+static void prefetch_thread (GTask *task, gpointer, gpointer data, GCancellable *cancel)
 {
-    if (ej->autohide)
+    const char *path = ((Prefetch *) data)->path;
+    gint64 start = g_get_monotonic_time (), deadline = start + PREFETCH_MS * 1000;
+    GQueue *dirs = g_queue_new ();
+    struct dirent *de;
+    struct stat st;
+    dev_t dev;
+    int prio, count = 0;
+
+    if (stat (path, &st) < 0)
     {
-        /* loop through all devices, checking for mounted volumes */
-        GList *driter, *drives = g_volume_monitor_get_connected_drives (ej->monitor);
+        g_queue_free (dirs);
+        g_task_return_boolean (task, FALSE);
+        return;
+    }
+    dev = st.st_dev;
 
-        gtk_widget_hide (ej->plugin);
-        gtk_widget_set_sensitive (ej->plugin, FALSE);
-        for (driter = drives; driter != NULL; driter = g_list_next (driter))
+    /* idle I/O class, so this only gets the disk when nothing else wants it;
+     * pool threads are reused, so the old class is put back afterwards */
+    prio = syscall (SYS_ioprio_get, IOPRIO_WHO_PROCESS, 0);
+    syscall (SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+
+    /* breadth first, so the levels the file manager shows first are read first */
+    g_queue_push_tail (dirs, g_strdup (path));
+    g_queue_push_tail (dirs, GINT_TO_POINTER (0));
+    while (!g_queue_is_empty (dirs))
+    {
+        char *dir = g_queue_pop_head (dirs);
+        int depth = GPOINTER_TO_INT (g_queue_pop_head (dirs));
+        DIR *d;
+
+        if (count < PREFETCH_ENTRIES && !g_cancellable_is_cancelled (cancel) && g_get_monotonic_time () < deadline
+            && (d = opendir (dir)))
         {
-            GDrive *drv = (GDrive *) driter->data;
-            if (is_drive_mounted (drv))
+            while ((de = readdir (d)) && count < PREFETCH_ENTRIES && !g_cancellable_is_cancelled (cancel))
             {
-                gtk_widget_show_all (ej->plugin);
-                gtk_widget_set_sensitive (ej->plugin, TRUE);
+                if (!strcmp (de->d_name, ".") || !strcmp (de->d_name, "..")) continue;
+                if (fstatat (dirfd (d), de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) continue;
+                count++;
+
+                /* stay on this filesystem, and out of anything below the depth limit */
+                if (S_ISDIR (st.st_mode) && st.st_dev == dev && depth < PREFETCH_DEPTH)
+                {
+                    g_queue_push_tail (dirs, g_build_filename (dir, de->d_name, NULL));
+                    g_queue_push_tail (dirs, GINT_TO_POINTER (depth + 1));
+                }
             }
+            closedir (d);
         }
-        g_list_free_full (drives, g_object_unref);
+        g_free (dir);
     }
-    else
+    g_queue_free (dirs);
+
+    if (prio >= 0) syscall (SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, prio);
+
+    DEBUG ("PREFETCH %s %d entries in %" G_GINT64_FORMAT " ms%s", path, count,
+        (g_get_monotonic_time () - start) / 1000, g_cancellable_is_cancelled (cancel) ? " (cancelled)" : "");
+    g_task_return_boolean (task, TRUE);
+}
+
+/* Only runs once the worker has returned, so nothing on the mount is open any more */
+
+static void prefetch_done (GObject *, GAsyncResult *, gpointer data)
+{
+    WATCHDOG ("prefetch", NULL);
+    Prefetch *p = (Prefetch *) data;
+    GList *l;
+
+    /* the plugin has gone, and has already let go of anything waiting */
+    if (!p->ej) return;
+
+    g_hash_table_remove (p->ej->prefetches, p->path);
+    for (l = p->waiters; l != NULL; l = l->next) prefetch_release ((PrefetchWait *) l->data);
+    mem_list_free (MEM_ASYNC, p->waiters, NULL);
+    p->waiters = NULL;
+}
+
+static void free_prefetch (gpointer data)
+{
+    Prefetch *p = (Prefetch *) data;
+    g_object_unref (p->cancel);
+    mem_free (p->path);
+    mem_free (p);
+}
+
+/* Cancelled prefetches stay listed until their worker exits */
+
+static Prefetch *prefetch_cancel (EjecterPlugin *ej, GMount *mnt)
+{
+    char *path = eject_get_mount_path (mnt);
+    Prefetch *p;
+
+    if (!path) return NULL;
+    p = g_hash_table_lookup (ej->prefetches, path);
+    if (p && !g_cancellable_is_cancelled (p->cancel))
     {
-        gtk_widget_show_all (ej->plugin);
-        gtk_widget_set_sensitive (ej->plugin, TRUE);
+        DEBUG ("PREFETCH %s CANCELLED FOR EJECT", path);
+        g_cancellable_cancel (p->cancel);
     }
+    g_free (path);
+    return p;
 }
 
-static void show_menu (EjecterPlugin *ej)
-{
-    hide_menu (ej);
+/* Stop the prefetch on a mount, or those on every mount of a drive, and call
+ * func once their workers have exited - straight away if there are none.
+ * Ejects of drives with dm-crypt or LVM volumes unmount them through UDisks
+ * without raising mount-pre-unmount, so this covers mounts GIO puts on the
+ * drive from a volume stacked on it too. */
 
-    ej->menu = gtk_menu_new ();
-    gtk_menu_set_reserve_toggle_size (GTK_MENU (ej->menu), FALSE);
+static void prefetch_wait (EjecterPlugin *ej, GDrive *drv, GMount *mnt, PrefetchWaitFunc func, gpointer data)
+{
+    PrefetchWait *w = mem_new0 (PrefetchWait, MEM_ASYNC);
+    GList *l, *mnts;
+    GDrive *d;
 
-    /* loop through all devices, creating menu items for them */
-    GList *driter, *drives = g_volume_monitor_get_connected_drives (ej->monitor);
-    int count = 0;
+    w->pending = 1;
+    w->func = func;
+    w->data = data;
 
-    for (driter = drives; driter != NULL; driter = g_list_next (driter))
+    if (mnt) prefetch_hold (ej, mnt, w);
+    else if (g_hash_table_size (ej->prefetches))
     {
-        GDrive *drv = (GDrive *) driter->data;
-        if (is_drive_mounted (drv))
+        mnts = g_volume_monitor_get_mounts (ej->monitor);
+        for (l = mnts; l != NULL; l = l->next)
         {
-            GtkWidget *item = create_menuitem (ej, drv);
-            CallbackData *dt = g_new0 (CallbackData, 1);
-            dt->ej = ej;
-            dt->drv = drv;
-            g_signal_connect (item, "activate", G_CALLBACK (handle_eject_clicked), dt);
-            gtk_menu_shell_append (GTK_MENU_SHELL (ej->menu), item);
-            count++;
+            d = g_mount_get_drive ((GMount *) l->data);
+            if (d == drv) prefetch_hold (ej, (GMount *) l->data, w);
+            if (d) g_object_unref (d);
         }
+        g_list_free_full (mnts, g_object_unref);
     }
-    g_list_free_full (drives, g_object_unref);
+    prefetch_release (w);
+}
 
-    if (count)
+static void prefetch_hold (EjecterPlugin *ej, GMount *mnt, PrefetchWait *w)
+{
+    Prefetch *p = prefetch_cancel (ej, mnt);
+
+    if (!p) return;
+    w->pending++;
+    p->waiters = mem_list_append (MEM_ASYNC, p->waiters, w);
+}
+
+static void prefetch_release (PrefetchWait *w)
+{
+    if (--w->pending > 0) return;
+    w->func (w->data);
+    mem_free (w);
+}
+
+static void prefetch_cancel_all (EjecterPlugin *ej)
+{
+    GHashTableIter iter;
+    gpointer val;
+
+    g_hash_table_iter_init (&iter, ej->prefetches);
+    while (g_hash_table_iter_next (&iter, NULL, &val))
+        g_cancellable_cancel (((Prefetch *) val)->cancel);
+}
+
+/* The plugin is going - the workers free themselves when they exit, and
+ * anything waiting on them is let go now, to find it has been cancelled */
+
+static void prefetch_detach_all (EjecterPlugin *ej)
+{
+    GHashTableIter iter;
+    gpointer val;
+    GList *l;
+
+    g_hash_table_iter_init (&iter, ej->prefetches);
+    while (g_hash_table_iter_next (&iter, NULL, &val))
     {
-        gtk_widget_show_all (ej->menu);
-        wrap_show_menu (ej->plugin, ej->menu);
+        Prefetch *p = (Prefetch *) val;
+        p->ej = NULL;
+        g_cancellable_cancel (p->cancel);
+        for (l = p->waiters; l != NULL; l = l->next) prefetch_release ((PrefetchWait *) l->data);
+        mem_list_free (MEM_ASYNC, p->waiters, NULL);
+        p->waiters = NULL;
     }
+    g_hash_table_remove_all (ej->prefetches);
 }
 
-static void hide_menu (EjecterPlugin *ej)
+/* Writeback limits - caps how much dirty data a slow drive can build up,
+ * and so how long an eject spends flushing it. The limit is the configured
+ * eject time at the fastest write rate seen on the drive. */
+
+static char *sysfs_read (const char *path)
 {
-    if (ej->menu)
+    char *val = NULL;
+
+    if (g_file_get_contents (path, &val, NULL, NULL)) g_strchomp (val);
+    return val;
+}
+
+static gboolean sysfs_write (const char *path, const char *val)
+{
+    gboolean res;
+    int fd;
+
+    /* attributes have to be written in place - no temporary file and rename;
+     * truncating does nothing to sysfs, but keeps a test's fake tree right */
+    fd = open (path, O_WRONLY | O_TRUNC | O_CLOEXEC);
+    if (fd < 0) return FALSE;
+    res = write (fd, val, strlen (val)) == (ssize_t) strlen (val);
+    close (fd);
+    return res;
+}
+
+static void bdi_limit (EjecterPlugin *ej, GDrive *drv)
+{
+    BdiLimit *bl;
+    char *dev, *path;
+    int i;
+
+    if (ej->max_eject <= 0) return;
+    dev = eject_get_devname (drv);
+    if (!dev || g_hash_table_contains (ej->bdi, dev))
     {
-        gtk_menu_popdown (GTK_MENU (ej->menu));
-        gtk_widget_destroy (ej->menu);
-        ej->menu = NULL;
+        g_free (dev);
+        return;
     }
+
+    bl = mem_new0 (BdiLimit, MEM_TRACKING);
+    bl->dir = mem_take_str (MEM_TRACKING, g_strdup_printf ("%s/sys/block/%s/bdi", eject_sysfs_root (), dev));
+    bl->rate = BDI_DEFAULT_RATE;
+    for (i = 0; i < BDI_ATTRS; i++)
+    {
+        path = g_build_filename (bl->dir, bdi_attrs[i], NULL);
+        bl->saved[i] = mem_take_str (MEM_TRACKING, sysfs_read (path));
+        g_free (path);
+    }
+    g_hash_table_insert (ej->bdi, mem_take_str (MEM_TRACKING, dev), bl);
+    bdi_apply (ej, bl);
 }
 
-static GtkWidget *create_menuitem (EjecterPlugin *ej, GDrive *d)
+static void bdi_apply (EjecterPlugin *ej, BdiLimit *bl)
 {
-    char buffer[1024], *name, *vname;
-    GList *vols, *iter;
-    GVolume *v;
-    GIcon *ic = NULL;
-    GtkWidget *item, *icon, *eject;
+    guint64 bytes = bl->rate * ej->max_eject, total;
+    char *path, *val, *str;
+    int ratio;
 
-    vols = g_drive_get_volumes (d);
-    name = g_drive_get_name (d);
+    /* max_bytes is only in newer kernels; otherwise work out the nearest percentage of the system limit */
+    if (bl->saved[1]) val = g_strdup_printf ("%" G_GUINT64_FORMAT, bytes);
+    else if (bl->saved[2])
+    {
+        total = (guint64) sysconf (_SC_PHYS_PAGES) * sysconf (_SC_PAGESIZE);
+        path = g_strdup_printf ("%s/proc/sys/vm/dirty_ratio", eject_sysfs_root ());
+        str = sysfs_read (path);
+        total = total * (str ? atoi (str) : 20) / 100;
+        g_free (str);
+        g_free (path);
+        ratio = CLAMP (total ? bytes * 100 / total : 100, 1, 100);
+        val = g_strdup_printf ("%d", ratio);
+    }
+    else return;
 
-    sprintf (buffer, "%s (", name);
-    gboolean first = TRUE;
-    for (iter = vols; iter != NULL; iter = g_list_next (iter))
+    path = g_build_filename (bl->dir, bdi_attrs[0], NULL);
+    if (bl->saved[0]) sysfs_write (path, "1");
+    g_free (path);
+
+    path = g_build_filename (bl->dir, bdi_attrs[bl->saved[1] ? 1 : 2], NULL);
+    if (sysfs_write (path, val))
     {
-        v = (GVolume *) iter->data;
-        vname = g_volume_get_name (v);
-        if (vname)
+        DEBUG ("WRITEBACK %s LIMITED TO %s", bl->dir, val);
+    }
+    else
+    {
+        DEBUG ("WRITEBACK %s NOT WRITABLE", path);
+        if (!bdi_warned) g_warning ("ejecter: cannot limit writeback on %s - the udev rule grants this to plugdev", bl->dir);
+        bdi_warned = TRUE;
+    }
+    g_free (path);
+    g_free (val);
+}
+
+static void bdi_restore (EjecterPlugin *ej, GDrive *drv)
+{
+    char *dev = eject_get_devname (drv);
+
+    if (dev) g_hash_table_remove (ej->bdi, dev);
+    g_free (dev);
+}
+
+/* Bring every mounted drive into line with a changed setting */
+
+void ejecter_update_limits (EjecterPlugin *ej)
+{
+    GHashTableIter iter;
+    gpointer key, val;
+
+    if (ej->max_eject <= 0)
+    {
+        g_hash_table_remove_all (ej->bdi);
+        return;
+    }
+
+    g_hash_table_iter_init (&iter, ej->bdi);
+    while (g_hash_table_iter_next (&iter, NULL, &val)) bdi_apply (ej, (BdiLimit *) val);
+
+    g_hash_table_iter_init (&iter, ej->mounted);
+    while (g_hash_table_iter_next (&iter, &key, NULL)) bdi_limit (ej, (GDrive *) key);
+}
+
+static void free_bdi_limit (gpointer data)
+{
+    BdiLimit *bl = (BdiLimit *) data;
+    char *path;
+    int i;
+
+    /* put things back in reverse, so the limit is lifted before strictlimit is */
+    for (i = BDI_ATTRS - 1; i >= 0; i--)
+    {
+        if (!bl->saved[i]) continue;
+        path = g_build_filename (bl->dir, bdi_attrs[i], NULL);
+        sysfs_write (path, bl->saved[i]);
+        g_free (path);
+        mem_free (bl->saved[i]);
+    }
+    mem_free (bl->dir);
+    mem_free (bl);
+}
+
+/* Tray icon activity overlay */
+
+static ActState act_sample (EjecterPlugin *ej, gboolean *busy)
+{
+    ActState state = ACT_NONE;
+    IoSample s, *last;
+    GList *l, *e;
+    char *dev;
+
+    *busy = ej->ejecting > 0 || (ej->inhibitor && ej->inhibitor->pending);
+    if (*busy) return ACT_FLUSHING;
+
+    /* only drives this plugin saw mounted - everything else is left alone */
+    for (l = ej->mdrives; l != NULL; l = l->next)
+    {
+        for (e = ej->ejdrives; e != NULL; e = e->next)
+            if (((EjectList *) e->data)->drv == l->data) break;
+        if (e)
         {
-            if (first)
+            if (state < ACT_SAFE) state = ACT_SAFE;
+            continue;
+        }
+
+        *busy = TRUE;
+        if (state < ACT_IDLE) state = ACT_IDLE;
+        dev = eject_get_devname ((GDrive *) l->data);
+        if (!dev || !read_io_sample (dev, &s))
+        {
+            g_free (dev);
+            continue;
+        }
+
+        last = g_hash_table_lookup (ej->activity, dev);
+        if (s.inflight || (last && s.wr_sectors != last->wr_sectors)) state = ACT_WRITING;
+
+        /* raise the writeback limit if the drive turns out faster than assumed */
+        BdiLimit *bl = g_hash_table_lookup (ej->bdi, dev);
+        if (bl && last && s.wr_sectors > last->wr_sectors && s.time > last->time)
+        {
+            guint64 rate = (s.wr_sectors - last->wr_sectors) * SECTOR_SIZE * G_USEC_PER_SEC / (s.time - last->time);
+            if (rate > bl->rate + bl->rate / 4)
             {
-                ic = g_volume_get_icon (v);
-                first = FALSE;
+                bl->rate = rate;
+                bdi_apply (ej, bl);
             }
-            else strcat (buffer, ", ");
-            strcat (buffer, vname);
-            g_free (vname);
+        }
+
+        if (!last) g_hash_table_insert (ej->activity, mem_take_str (MEM_TRACKING, dev), mem_dup (MEM_TRACKING, &s, sizeof (IoSample)));
+        else
+        {
+            *last = s;
+            g_free (dev);
         }
     }
-    g_list_free_full (vols, g_object_unref);
+    return state;
+}
 
-    strcat (buffer, ")");
-    g_free (name);
+/* Poll quickly while anything is happening, halving the rate on each idle
+ * tick, and not at all once nothing is mounted */
 
-    if (!ic) ic = g_drive_get_icon (d);
-    icon = gtk_image_new_from_gicon (ic, wrap_icon_size (ej) >= 32 ? GTK_ICON_SIZE_LARGE_TOOLBAR : GTK_ICON_SIZE_BUTTON);
-    g_object_unref (ic);
+static gboolean act_tick (gpointer data)
+{
+    WATCHDOG ("timer", NULL);
+    EjecterPlugin *ej = (EjecterPlugin *) data;
+    guint interval = ej->act_interval;
+    gboolean busy;
+    ActState state;
 
-    item = wrap_new_menu_item (ej, buffer, 40, NULL);
-    lxpanel_plugin_update_menu_icon (item, icon);
+    state = act_sample (ej, &busy);
+    act_show (ej, state);
 
-    eject = gtk_image_new ();
-    wrap_set_menu_icon (ej, eject, "media-eject");
-    lxpanel_plugin_append_menu_icon (item, eject);
+    if (!busy)
+    {
+        g_hash_table_remove_all (ej->activity);
+        ej->act_interval = 0;
+        ej->act_timer = 0;
+        return FALSE;
+    }
 
-    gtk_widget_show_all (item);
+    if (state >= ACT_WRITING) ej->act_interval = ACT_MIN_MS;
+    else if (ej->act_interval < ACT_MAX_MS) ej->act_interval *= 2;
+    if (ej->act_interval == interval) return TRUE;
 
-    return item;
+    ej->act_timer = g_timeout_add (ej->act_interval, act_tick, ej);
+    return FALSE;
 }
 
-/*----------------------------------------------------------------------------*/
-/* wf-panel plugin functions                                                  */
-/*----------------------------------------------------------------------------*/
+static void act_kick (EjecterPlugin *ej)
+{
+    if (ej->act_timer)
+    {
+        if (ej->act_interval == ACT_MIN_MS) return;
+        g_source_remove (ej->act_timer);
+    }
+    ej->act_interval = ACT_MIN_MS;
+    ej->act_timer = 0;
+    if (act_tick (ej) && !ej->act_timer) ej->act_timer = g_timeout_add (ej->act_interval, act_tick, ej);
+}
 
-/* Handler for button click */
-static void ejecter_button_clicked (GtkWidget *, EjecterPlugin * ej)
+/* Called whenever the theme icon is set, so the overlays are redrawn from it */
+
+static void act_set_base (EjecterPlugin *ej)
 {
-    CHECK_LONGPRESS
-    show_menu (ej);
+    g_clear_object (&ej->act_base);
+    g_hash_table_remove_all (ej->act_icons);
+
+    if (gtk_image_get_storage_type (GTK_IMAGE (ej->tray_icon)) == GTK_IMAGE_PIXBUF)
+        ej->act_base = g_object_ref (gtk_image_get_pixbuf (GTK_IMAGE (ej->tray_icon)));
+    ej->act_state = ACT_NONE;
 }
 
-/* Handler for system config changed message from panel */
-void ejecter_update_display (EjecterPlugin * ej)
+static GdkPixbuf *act_render (EjecterPlugin *ej, ActState state)
 {
-    wrap_set_taskbar_icon (ej, ej->tray_icon, "plugin-eject");
-    update_icon (ej);
+    int width = gdk_pixbuf_get_width (ej->act_base), height = gdk_pixbuf_get_height (ej->act_base);
+    double r = height / 6.0;
+    cairo_surface_t *surface;
+    GdkPixbuf *pixbuf;
+    cairo_t *cr;
+
+    surface = cairo_image_surface_create (CAIRO_FORMAT_ARGB32, width, height);
+    cr = cairo_create (surface);
+    gdk_cairo_set_source_pixbuf (cr, ej->act_base, 0, 0);
+    cairo_paint (cr);
+
+    /* a dot in the bottom right corner - amber while writing, red while flushing, green once all are safe */
+    cairo_arc (cr, width - r - 1, height - r - 1, r, 0, 2 * G_PI);
+    if (state == ACT_FLUSHING) cairo_set_source_rgb (cr, 0.85, 0.15, 0.15);
+    else if (state == ACT_WRITING) cairo_set_source_rgb (cr, 0.95, 0.65, 0.1);
+    else cairo_set_source_rgb (cr, 0.2, 0.7, 0.25);
+    cairo_fill_preserve (cr);
+    cairo_set_source_rgba (cr, 0, 0, 0, 0.5);
+    cairo_set_line_width (cr, 1);
+    cairo_stroke (cr);
+    cairo_destroy (cr);
+
+    pixbuf = gdk_pixbuf_get_from_surface (surface, 0, 0, width, height);
+    cairo_surface_destroy (surface);
+    return pixbuf;
 }
 
-/* Handler for control message */
-gboolean ejecter_control_msg (EjecterPlugin *ej, const char *cmd)
+static void act_show (EjecterPlugin *ej, ActState state)
 {
-    DEBUG ("Eject command device %s\n", cmd);
+    if ((int) state == ej->act_state || !ej->act_base) return;
+    ej->act_state = state;
 
-    /* Loop through all drives until we find the one matching the supplied device */
-    GList *iter, *drives = g_volume_monitor_get_connected_drives (ej->monitor);
-    for (iter = drives; iter != NULL; iter = g_list_next (iter))
-    {
-        GDrive *d = iter->data;
-        char *id = g_drive_get_identifier (d, "unix-device");
+    if (ej->changed) ej->changed (EJECTER_CHANGED_ACTIVITY, ej->changed_data);
+    else gtk_image_set_from_pixbuf (GTK_IMAGE (ej->tray_icon), ejecter_activity_icon (ej));
+}
 
-        if (!g_strcmp0 (id, cmd)) 
-        {
-            DEBUG ("EXTERNAL EJECT %s", g_drive_get_name (d));
-            log_eject (ej, d);
-        }
-        g_free (id);
+/* Icon for the current activity state - owned by the plugin, and NULL
+ * until the theme icon has been loaded */
+
+GdkPixbuf *ejecter_activity_icon (EjecterPlugin *ej)
+{
+    GdkPixbuf *pixbuf;
+    gpointer key;
+
+    if (!ej->act_base) return NULL;
+    if (ej->act_state == ACT_NONE || ej->act_state == ACT_IDLE) return ej->act_base;
+
+    key = GINT_TO_POINTER (gdk_pixbuf_get_height (ej->act_base) << 4 | ej->act_state);
+    pixbuf = g_hash_table_lookup (ej->act_icons, key);
+    if (!pixbuf)
+    {
+        pixbuf = act_render (ej, ej->act_state);
+        g_hash_table_insert (ej->act_icons, key, pixbuf);
     }
-    g_list_free_full (drives, g_object_unref);
-    return TRUE;
+    return pixbuf;
 }
 
 void ejecter_init (EjecterPlugin *ej)
@@ -671,9 +3225,20 @@ void ejecter_init (EjecterPlugin *ej)
     bindtextdomain (GETTEXT_PACKAGE, PACKAGE_LOCALE_DIR);
     bind_textdomain_codeset (GETTEXT_PACKAGE, "UTF-8");
 
-    /* Allocate icon as a child of top level */
-    ej->tray_icon = gtk_image_new ();
-    gtk_container_add (GTK_CONTAINER (ej->plugin), ej->tray_icon);
+    /* a limit in bytes on what the plugin itself allocates, for tests */
+    if (g_getenv ("EJECTER_MEM_BUDGET")) mem_budget = g_ascii_strtoull (g_getenv ("EJECTER_MEM_BUDGET"), NULL, 10);
+
+    /* how long a handler may take before it counts as a stall, and whether to log them */
+    if (g_getenv ("EJECTER_STALL_MS")) stall_threshold = g_ascii_strtoll (g_getenv ("EJECTER_STALL_MS"), NULL, 10) * 1000;
+    stall_log = g_getenv ("EJECTER_STALL_LOG") != NULL;
+    eject_set_watch (stall_check);
+
+    /* Allocate icon as a child of top level, unless the view supplies its own */
+    if (!ej->tray_icon)
+    {
+        ej->tray_icon = gtk_image_new ();
+        gtk_container_add (GTK_CONTAINER (ej->plugin), ej->tray_icon);
+    }
     wrap_set_taskbar_icon (ej, ej->tray_icon, "plugin-eject");
     gtk_widget_set_tooltip_text (ej->tray_icon, _("Select a drive in menu to eject safely"));
 
@@ -687,6 +3252,31 @@ void ejecter_init (EjecterPlugin *ej)
     ej->popup = NULL;
     ej->menu = NULL;
     ej->hide_timer = 0;
+    ej->menu_items = NULL;
+    ej->iostats = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, mem_free);
+    ej->io_timer = 0;
+    ej->fsinfo = g_hash_table_new_full (g_str_hash, g_str_equal, mem_free, free_fs_info);
+    ej->fs_cancel = g_cancellable_new ();
+    ej->index = eject_index_new (NULL);
+    ej->index_drives = NULL;
+    ej->index_dirty = TRUE;
+    ej->stats = g_hash_table_new_full (g_str_hash, g_str_equal, mem_free, mem_free);
+    ej->drive_ids = g_hash_table_new_full (g_direct_hash, g_direct_equal, g_object_unref, mem_free);
+    ej->journal = NULL;
+    ej->cancel = g_cancellable_new ();
+    ej->activity = g_hash_table_new_full (g_str_hash, g_str_equal, mem_free, mem_free);
+    ej->act_timer = 0;
+    ej->act_interval = 0;
+    ej->act_state = ACT_NONE;
+    ej->ejecting = 0;
+    ej->act_base = NULL;
+    ej->act_icons = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, g_object_unref);
+    act_set_base (ej);
+    ej->prefetches = g_hash_table_new (g_str_hash, g_str_equal);
+    ej->profiles = profile_load ();
+    ej->bdi = g_hash_table_new_full (g_str_hash, g_str_equal, mem_free, free_bdi_limit);
+    ej->mounted = g_hash_table_new_full (g_direct_hash, g_direct_equal, g_object_unref, NULL);
+    ej->drive_groups = g_hash_table_new_full (g_direct_hash, g_direct_equal, g_object_unref, mem_free);
 
     /* Get volume monitor and connect to events */
     ej->monitor = g_volume_monitor_get ();
@@ -705,17 +3295,33 @@ void ejecter_init (EjecterPlugin *ej)
     {
         GVolume* vol = G_VOLUME (l->data);
         if (ej->automount && g_volume_should_automount (vol) && g_volume_can_mount (vol) && !g_volume_get_mount (vol))
-            g_volume_mount (vol, 0, NULL, NULL, NULL, NULL);
+            automount_volume (ej, vol, FALSE);
         g_object_unref (vol);
     }
     g_list_free (vols);
 
+    /* the journal has to be replayed before current mounts are logged over it */
+    ej->journal = journal_open ();
+    journal_restore (ej);
     log_init_mounts (ej);
 
+    inhibit_init (ej);
+
+    /* the only time every drive is checked - events only look at their own */
+    GList *drives = g_volume_monitor_get_connected_drives (ej->monitor);
+    for (l = drives; l != NULL; l = l->next)
+    {
+        if (is_drive_mounted ((GDrive *) l->data)) g_hash_table_add (ej->mounted, g_object_ref (l->data));
+        drive_group (ej, (GDrive *) l->data);
+    }
+    g_list_free_full (drives, g_object_unref);
+    update_icon (ej, NULL);
+
 #ifndef LXPLUG
     GSimpleAction *act = g_simple_action_new_stateful ("open-mount", G_VARIANT_TYPE ("s"), g_variant_new_string (""));
     g_signal_connect (act, "activate", G_CALLBACK (open_mount), NULL);
     g_action_map_add_action (G_ACTION_MAP (g_application_get_default ()), G_ACTION (act));
+    g_object_unref (act);
 #endif
 }
 
@@ -723,6 +3329,42 @@ void ejecter_destructor (gpointer user_data)
 {
     EjecterPlugin *ej = (EjecterPlugin *) user_data;
 
+    /* stop any more events arriving for this instance */
+    g_signal_handlers_disconnect_by_data (ej->monitor, ej);
+    g_object_unref (ej->monitor);
+#ifndef LXPLUG
+    g_action_map_remove_action (G_ACTION_MAP (g_application_get_default ()), "open-mount");
+#endif
+
+    /* outstanding async operations hold a reference to one of these, not to the plugin */
+    g_cancellable_cancel (ej->cancel);
+    g_object_unref (ej->cancel);
+    g_cancellable_cancel (ej->fs_cancel);
+    g_object_unref (ej->fs_cancel);
+    journal_close (ej->journal);
+    inhibit_close (ej->inhibitor);
+
+    hide_menu (ej);
+    if (ej->act_timer) g_source_remove (ej->act_timer);
+    prefetch_detach_all (ej);
+
+    mem_list_free (MEM_TRACKING, ej->ejdrives, mem_free);
+    mem_list_free (MEM_TRACKING, ej->mdrives, NULL);
+    g_hash_table_destroy (ej->iostats);
+    g_hash_table_destroy (ej->fsinfo);
+    g_hash_table_destroy (ej->index);
+    g_list_free_full (ej->index_drives, g_object_unref);
+    g_hash_table_destroy (ej->stats);
+    g_hash_table_destroy (ej->drive_ids);
+    g_hash_table_destroy (ej->activity);
+    g_hash_table_destroy (ej->act_icons);
+    g_hash_table_destroy (ej->prefetches);
+    if (ej->profiles) g_key_file_free (ej->profiles);
+    g_hash_table_destroy (ej->bdi);
+    g_hash_table_destroy (ej->mounted);
+    g_hash_table_destroy (ej->drive_groups);
+    g_clear_object (&ej->act_base);
+
     g_free (ej);
 }
 
@@ -746,10 +3388,14 @@ static GtkWidget *ejecter_constructor (LXPanel *panel, config_setting_t *setting
     /* Set config defaults */
     ej->autohide = TRUE;
     ej->automount = TRUE;
+    ej->prefetch = FALSE;
+    ej->max_eject = 0;
 
     /* Read config */
     conf_table[0].value = (void *) &ej->autohide;
     conf_table[1].value = (void *) &ej->automount;
+    conf_table[2].value = (void *) &ej->prefetch;
+    conf_table[3].value = (void *) &ej->max_eject;
     lxplug_read_settings (ej->settings, conf_table);
 
     ejecter_init (ej);
@@ -790,6 +3436,7 @@ static gboolean ejecter_apply_configuration (gpointer user_data)
 
     lxplug_write_settings (ej->settings, conf_table);
 
+    ejecter_update_limits (ej);
     ejecter_update_display (ej);
     return FALSE;
 }
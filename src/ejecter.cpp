@@ -40,25 +40,63 @@ extern "C" {
 
 void WayfireEjecter::command (const char *cmd)
 {
-    ejecter_control_msg (ej, cmd);
+    ejecter_control_msg (ej.get (), cmd);
 }
 
 bool WayfireEjecter::set_icon (void)
 {
-    ejecter_update_display (ej);
+    /* the drives were checked in ejecter_init - only the theme icon is needed here */
+    ejecter_update_icon (ej.get ());
     return false;
 }
 
+void WayfireEjecter::changed_cb (EjecterChange what, gpointer data)
+{
+    static_cast <WayfireEjecter *> (data)->on_changed (what);
+}
+
+void WayfireEjecter::on_changed (EjecterChange what)
+{
+    GdkPixbuf *pixbuf;
+
+    switch (what)
+    {
+        case EJECTER_CHANGED_DRIVES :
+            if (ej->visible) plugin->show_all ();
+            else plugin->hide ();
+            plugin->set_sensitive (ej->visible);
+            break;
+
+        case EJECTER_CHANGED_ACTIVITY :
+            /* the pixbuf belongs to the plugin - the image takes its own reference */
+            if ((pixbuf = ejecter_activity_icon (ej.get ()))) icon->set (Glib::wrap (pixbuf, true));
+            break;
+    }
+}
+
 void WayfireEjecter::read_settings (void)
 {
     ej->autohide = autohide;
     ej->automount = automount;
+    ej->prefetch = prefetch;
+    ej->max_eject = max_eject;
 }
 
 void WayfireEjecter::settings_changed_cb (void)
 {
     read_settings ();
-    ejecter_update_display (ej);
+}
+
+void WayfireEjecter::max_eject_changed_cb (void)
+{
+    read_settings ();
+    ejecter_update_limits (ej.get ());
+}
+
+void WayfireEjecter::autohide_changed_cb (void)
+{
+    read_settings ();
+    ejecter_update_display (ej.get ());
 }
 
 void WayfireEjecter::init (Gtk::HBox *container)
@@ -68,9 +106,16 @@ void WayfireEjecter::init (Gtk::HBox *container)
     plugin->set_name (PLUGIN_NAME);
     container->pack_start (*plugin, false, false);
 
+    /* The icon belongs to the view; the plugin only says what it should show */
+    icon = std::make_unique <Gtk::Image> ();
+    plugin->add (*icon);
+
     /* Setup structure */
-    ej = g_new0 (EjecterPlugin, 1);
+    ej.reset (g_new0 (EjecterPlugin, 1));
     ej->plugin = (GtkWidget *)((*plugin).gobj());
+    ej->tray_icon = (GtkWidget *)((*icon).gobj());
+    ej->changed = &WayfireEjecter::changed_cb;
+    ej->changed_data = this;
     icon_timer = Glib::signal_idle().connect (sigc::mem_fun (*this, &WayfireEjecter::set_icon));
 
     /* Add long press for right click */
@@ -78,17 +123,18 @@ void WayfireEjecter::init (Gtk::HBox *container)
 
     /* Initialise the plugin */
     read_settings ();
-    ejecter_init (ej);
+    ejecter_init (ej.get ());
 
     /* Setup callbacks */
-    autohide.set_callback (sigc::mem_fun (*this, &WayfireEjecter::settings_changed_cb));
+    autohide.set_callback (sigc::mem_fun (*this, &WayfireEjecter::autohide_changed_cb));
     automount.set_callback (sigc::mem_fun (*this, &WayfireEjecter::settings_changed_cb));
+    prefetch.set_callback (sigc::mem_fun (*this, &WayfireEjecter::settings_changed_cb));
+    max_eject.set_callback (sigc::mem_fun (*this, &WayfireEjecter::max_eject_changed_cb));
 }
 
 WayfireEjecter::~WayfireEjecter()
 {
     icon_timer.disconnect ();
-    ejecter_destructor (ej);
 }
 
 /* End of file */
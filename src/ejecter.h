@@ -31,6 +31,11 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #define PLUGIN_TITLE N_("Ejecter")
 
+typedef enum {
+    EJECTER_CHANGED_DRIVES,         /* A drive was mounted, unmounted or removed - visible may have changed */
+    EJECTER_CHANGED_ACTIVITY        /* Activity state has changed - see ejecter_activity_icon */
+} EjecterChange;
+
 typedef struct 
 {
     GtkWidget *plugin;
@@ -49,12 +54,42 @@ typedef struct
     GVolumeMonitor *monitor;
     gboolean autohide;
     gboolean automount;
+    gboolean prefetch;
+    int max_eject;                  /* Longest an eject should spend flushing, in seconds - 0 leaves writeback alone */
     GList *ejdrives;
     GList *mdrives;
     guint hide_timer;
+    GList *menu_items;              /* MenuEntry for each drive in the open menu */
+    GHashTable *iostats;            /* I/O sample rings, keyed by block device name */
+    guint io_timer;                 /* I/O sampling timer - only runs while the menu is shown */
+    GHashTable *fsinfo;             /* Cached filesystem usage, keyed by mount root path */
+    GCancellable *fs_cancel;        /* Cancels outstanding filesystem usage queries */
+    GHashTable *index;              /* Drive lookup for control messages, keyed by device, label, UUID or mount */
+    GList *index_drives;            /* Connected drives at the time the index was built */
+    gboolean index_dirty;           /* Index needs rebuilding before next use */
+    GHashTable *stats;              /* DevStats for each drive ejected, keyed by device */
+    struct _Journal *journal;       /* Persistent record of drive state across restarts */
+    GHashTable *drive_ids;          /* Stable ID for each drive seen, keyed by GDrive */
+    struct _Inhibitor *inhibitor;   /* logind delay lock for flushing before sleep or shutdown */
+    GCancellable *cancel;           /* Cancelled on destruction, detaching any ejects still in progress */
+    GHashTable *activity;           /* Last I/O sample for each mounted drive, keyed by block device name */
+    guint act_timer;                /* Activity polling timer - stopped while nothing is mounted */
+    guint act_interval;             /* Current activity polling interval in ms */
+    int act_state;                  /* Activity shown on the tray icon */
+    int ejecting;                   /* Ejects started from the plugin and not yet finished */
+    GdkPixbuf *act_base;            /* Tray icon without overlay, as last set from the theme */
+    GHashTable *act_icons;          /* Tray icon with overlay, keyed by state and size */
+    GHashTable *prefetches;         /* Directory prefetch running on each mount root path, until its worker exits */
+    GKeyFile *profiles;             /* Mount option profiles, or NULL if none are configured */
+    GHashTable *bdi;                /* Writeback limits applied to each mounted drive, keyed by block device name */
+    GHashTable *mounted;            /* Drives with something mounted, kept up to date from events */
+    GHashTable *drive_groups;       /* Hub each connected drive is plugged into, keyed by GDrive - found when it connects */
+    gboolean visible;               /* Icon should be shown - something is mounted, or autohide is off */
+    void (*changed) (EjecterChange what, gpointer data);    /* If set, called instead of updating the button and icon */
+    gpointer changed_data;
 } EjecterPlugin;
 
-extern conf_table_t conf_table[3];
+extern conf_table_t conf_table[5];
 
 /*----------------------------------------------------------------------------*/
 /* Prototypes                                                                 */
@@ -62,6 +97,9 @@ extern conf_table_t conf_table[3];
 
 extern void ejecter_init (EjecterPlugin *ej);
 extern void ejecter_update_display (EjecterPlugin *ej);
+extern void ejecter_update_icon (EjecterPlugin *ej);
+extern void ejecter_update_limits (EjecterPlugin *ej);
+extern GdkPixbuf *ejecter_activity_icon (EjecterPlugin *ej);
 extern gboolean ejecter_control_msg (EjecterPlugin *ej, const char *cmd);
 extern void ejecter_destructor (gpointer user_data);
 
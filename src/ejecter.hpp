@@ -30,6 +30,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include <widget.hpp>
 #include <gtkmm/button.h>
+#include <gtkmm/image.h>
 #include <gtkmm/gesturelongpress.h>
 
 extern "C" {
@@ -37,18 +38,29 @@ extern "C" {
 #include "ejecter.h"
 }
 
+/* Frees the C plugin state along with the object that owns it */
+struct EjecterDeleter
+{
+    void operator() (EjecterPlugin *ej) const { ejecter_destructor (ej); }
+};
+
 class WayfireEjecter : public WayfireWidget
 {
     std::unique_ptr <Gtk::Button> plugin;
+    std::unique_ptr <Gtk::Image> icon;
     Glib::RefPtr<Gtk::GestureLongPress> gesture;
 
     sigc::connection icon_timer;
 
     WfOption <bool> autohide {"panel/ejecter_autohide"};
     WfOption <bool> automount {"panel/ejecter_automount"};
+    WfOption <bool> prefetch {"panel/ejecter_prefetch"};
+    WfOption <int> max_eject {"panel/ejecter_max_eject"};
+
+    /* plugin - declared after the button and icon, so it is torn down before them */
+    std::unique_ptr <EjecterPlugin, EjecterDeleter> ej;
 
-    /* plugin */
-    EjecterPlugin *ej;
+    static void changed_cb (EjecterChange what, gpointer data);
 
   public:
 
@@ -58,6 +70,9 @@ class WayfireEjecter : public WayfireWidget
     bool set_icon (void);
     void read_settings (void);
     void settings_changed_cb (void);
+    void autohide_changed_cb (void);
+    void max_eject_changed_cb (void);
+    void on_changed (EjecterChange what);
 };
 
 #endif /* end of include guard: WIDGETS_EJECTER_HPP */
@@ -0,0 +1,261 @@
+/*============================================================================
+Copyright (c) 2026 Raspberry Pi
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+============================================================================*/
+
+/* Writeback limit test - points EJECTER_SYSFS_ROOT at a fake sysfs tree and
+ * checks that limits are applied to a drive, follow changes to the setting,
+ * and are put back as they were when lifted. One drive has max_bytes, the
+ * other only max_ratio, as on older kernels. */
+
+#include <glib/gstdio.h>
+
+#include "ejecter.c"
+
+/*----------------------------------------------------------------------------*/
+/* Typedefs and macros                                                        */
+/*----------------------------------------------------------------------------*/
+
+#define DIRTY_RATIO 20
+
+typedef struct {
+    GObject parent;
+    char *dev;
+} FakeDrive;
+
+typedef struct {
+    GObjectClass parent_class;
+} FakeDriveClass;
+
+/*----------------------------------------------------------------------------*/
+/* Global data                                                                */
+/*----------------------------------------------------------------------------*/
+
+static char *root;
+static int failures;
+
+/*----------------------------------------------------------------------------*/
+/* Prototypes                                                                 */
+/*----------------------------------------------------------------------------*/
+
+static void fake_drive_iface_init (GDriveIface *iface);
+
+G_DEFINE_TYPE_WITH_CODE (FakeDrive, fake_drive, G_TYPE_OBJECT, G_IMPLEMENT_INTERFACE (G_TYPE_DRIVE, fake_drive_iface_init))
+
+/*----------------------------------------------------------------------------*/
+/* Function definitions                                                       */
+/*----------------------------------------------------------------------------*/
+
+/* Panel stand-ins - nothing here shows anything */
+
+int stub_notify (const char *)
+{
+    return 0;
+}
+
+void stub_set_icon (GtkWidget *)
+{
+}
+
+void stub_drop (GtkWidget *)
+{
+}
+
+/* A drive with nothing but a device node */
+
+static char *fake_drive_get_name (GDrive *drv)
+{
+    return g_strdup (((FakeDrive *) drv)->dev);
+}
+
+static char *fake_drive_get_identifier (GDrive *drv, const char *kind)
+{
+    if (g_strcmp0 (kind, G_DRIVE_IDENTIFIER_KIND_UNIX_DEVICE)) return NULL;
+    return g_strdup_printf ("/dev/%s", ((FakeDrive *) drv)->dev);
+}
+
+static void fake_drive_iface_init (GDriveIface *iface)
+{
+    iface->get_name = fake_drive_get_name;
+    iface->get_identifier = fake_drive_get_identifier;
+}
+
+static void fake_drive_finalize (GObject *obj)
+{
+    g_free (((FakeDrive *) obj)->dev);
+    G_OBJECT_CLASS (fake_drive_parent_class)->finalize (obj);
+}
+
+static void fake_drive_init (FakeDrive *)
+{
+}
+
+static void fake_drive_class_init (FakeDriveClass *klass)
+{
+    G_OBJECT_CLASS (klass)->finalize = fake_drive_finalize;
+}
+
+static GDrive *fake_drive_new (const char *dev)
+{
+    FakeDrive *drv = g_object_new (fake_drive_get_type (), NULL);
+    drv->dev = g_strdup (dev);
+    return G_DRIVE (drv);
+}
+
+/* Fake sysfs */
+
+static void fake_write (const char *rel, const char *val)
+{
+    char *path = g_build_filename (root, rel, NULL), *dir = g_path_get_dirname (path);
+
+    g_mkdir_with_parents (dir, 0755);
+    g_file_set_contents (path, val, -1, NULL);
+    g_free (dir);
+    g_free (path);
+}
+
+static void check (const char *rel, const char *want)
+{
+    char *path = g_build_filename (root, rel, NULL), *val = sysfs_read (path);
+
+    if (g_strcmp0 (val, want))
+    {
+        g_printerr ("%s is %s, expected %s\n", rel, val ? val : "missing", want);
+        failures++;
+    }
+    g_free (val);
+    g_free (path);
+}
+
+static void check_bytes (const char *rel, int secs)
+{
+    char *want = g_strdup_printf ("%" G_GUINT64_FORMAT, (guint64) BDI_DEFAULT_RATE * secs);
+    check (rel, want);
+    g_free (want);
+}
+
+static void check_ratio (const char *rel, int secs)
+{
+    guint64 total = (guint64) sysconf (_SC_PHYS_PAGES) * sysconf (_SC_PAGESIZE) * DIRTY_RATIO / 100;
+    guint64 ratio = CLAMP ((guint64) BDI_DEFAULT_RATE * secs * 100 / total, 1, 100);
+    char *want = g_strdup_printf ("%" G_GUINT64_FORMAT, ratio);
+    check (rel, want);
+    g_free (want);
+}
+
+static void remove_tree (const char *path)
+{
+    GDir *dir = g_dir_open (path, 0, NULL);
+    const char *name;
+
+    while (dir && (name = g_dir_read_name (dir)))
+    {
+        char *child = g_build_filename (path, name, NULL);
+        if (g_file_test (child, G_FILE_TEST_IS_DIR)) remove_tree (child);
+        else g_remove (child);
+        g_free (child);
+    }
+    if (dir) g_dir_close (dir);
+    g_rmdir (path);
+}
+
+int main (void)
+{
+    EjecterPlugin *ej = g_new0 (EjecterPlugin, 1);
+    GDrive *sdx, *sdy;
+    int i;
+
+    root = g_dir_make_tmp ("ejecter-bdi-XXXXXX", NULL);
+    g_setenv ("EJECTER_SYSFS_ROOT", root, TRUE);
+
+    fake_write ("proc/sys/vm/dirty_ratio", G_STRINGIFY (DIRTY_RATIO));
+    fake_write ("sys/block/sdx/bdi/strict_limit", "0");
+    fake_write ("sys/block/sdx/bdi/max_bytes", "0");
+    fake_write ("sys/block/sdx/bdi/max_ratio", "100");
+    fake_write ("sys/block/sdy/bdi/strict_limit", "0");
+    fake_write ("sys/block/sdy/bdi/max_ratio", "100");
+
+    ej->bdi = g_hash_table_new_full (g_str_hash, g_str_equal, mem_free, free_bdi_limit);
+    ej->mounted = g_hash_table_new_full (g_direct_hash, g_direct_equal, g_object_unref, NULL);
+    sdx = fake_drive_new ("sdx");
+    sdy = fake_drive_new ("sdy");
+
+    /* nothing is touched while the setting is off */
+    bdi_limit (ej, sdx);
+    check ("sys/block/sdx/bdi/max_bytes", "0");
+
+    /* mounted with a limit set */
+    ej->max_eject = 10;
+    g_hash_table_add (ej->mounted, g_object_ref (sdx));
+    g_hash_table_add (ej->mounted, g_object_ref (sdy));
+    bdi_limit (ej, sdx);
+    bdi_limit (ej, sdy);
+    check ("sys/block/sdx/bdi/strict_limit", "1");
+    check_bytes ("sys/block/sdx/bdi/max_bytes", 10);
+    check ("sys/block/sdx/bdi/max_ratio", "100");
+    check ("sys/block/sdy/bdi/strict_limit", "1");
+    check_ratio ("sys/block/sdy/bdi/max_ratio", 10);
+
+    /* the setting changes with both still mounted */
+    ej->max_eject = 30;
+    ejecter_update_limits (ej);
+    check_bytes ("sys/block/sdx/bdi/max_bytes", 30);
+    check_ratio ("sys/block/sdy/bdi/max_ratio", 30);
+
+    /* ejected, then mounted again */
+    bdi_restore (ej, sdx);
+    check ("sys/block/sdx/bdi/strict_limit", "0");
+    check ("sys/block/sdx/bdi/max_bytes", "0");
+    bdi_limit (ej, sdx);
+    check_bytes ("sys/block/sdx/bdi/max_bytes", 30);
+
+    /* the setting is turned off */
+    ej->max_eject = 0;
+    ejecter_update_limits (ej);
+    check ("sys/block/sdx/bdi/strict_limit", "0");
+    check ("sys/block/sdx/bdi/max_bytes", "0");
+    check ("sys/block/sdy/bdi/strict_limit", "0");
+    check ("sys/block/sdy/bdi/max_ratio", "100");
+
+    g_hash_table_destroy (ej->bdi);
+    g_hash_table_destroy (ej->mounted);
+    g_object_unref (sdx);
+    g_object_unref (sdy);
+    g_free (ej);
+
+    for (i = 0; i < MEM_TAGS; i++)
+    {
+        if (!mem_counts[i].live) continue;
+        g_printerr ("%s: %" G_GSIZE_FORMAT " bytes still allocated\n", mem_tags[i], mem_counts[i].live);
+        failures++;
+    }
+
+    remove_tree (root);
+    g_free (root);
+    return failures ? 1 : 0;
+}
+
+/* End of file */
+/*----------------------------------------------------------------------------*/
@@ -0,0 +1,68 @@
+/*============================================================================
+Copyright (c) 2026 Raspberry Pi
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+============================================================================*/
+
+/* Stand-in for the panel's lxutils.h, with just what the plugin uses, so
+ * that it can be built and run outside a panel */
+
+#ifndef LXUTILS_H
+#define LXUTILS_H
+
+#include <gtk/gtk.h>
+
+typedef enum {
+    CONF_TYPE_NONE,
+    CONF_TYPE_BOOL,
+    CONF_TYPE_INT,
+    CONF_TYPE_STRING
+} conf_type_t;
+
+typedef struct {
+    conf_type_t type;
+    const char *name;
+    const char *label;
+    void *value;
+} conf_table_t;
+
+#define CHECK_LONGPRESS
+#define wrap_notify(panel,msg) stub_notify (msg)
+#define wrap_notify_clear(seq) ((void) (seq))
+#define wrap_new_menu_item(plugin,text,maxlen,icon) gtk_menu_item_new_with_label (text)
+#define wrap_set_menu_icon(plugin,image,icon)
+#define wrap_set_taskbar_icon(plugin,image,icon) stub_set_icon (image)
+#define wrap_show_menu(widget,menu) gtk_menu_popup_at_widget (GTK_MENU (menu), widget, GDK_GRAVITY_NORTH_WEST, GDK_GRAVITY_NORTH_WEST, NULL)
+#define wrap_icon_size(plugin) 24
+#define lxpanel_plugin_update_menu_icon(item,icon) stub_drop (icon)
+#define lxpanel_plugin_append_menu_icon(item,icon) stub_drop (icon)
+
+extern int stub_notify (const char *msg);
+extern void stub_set_icon (GtkWidget *image);
+extern void stub_drop (GtkWidget *widget);
+
+#endif
+
+/* End of file */
+/*----------------------------------------------------------------------------*/
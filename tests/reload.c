@@ -0,0 +1,258 @@
+/*============================================================================
+Copyright (c) 2026 Raspberry Pi
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+============================================================================*/
+
+/* Reload test - creates and destroys the plugin over and over with ejects
+ * still in progress, reporting how long each reload takes. Built with
+ * AddressSanitizer, so anything left behind or touched after the plugin
+ * has gone fails the run. The plugin source is included directly so that
+ * ejects can be started and its allocation counters checked. */
+
+#include <glib/gstdio.h>
+
+#include "ejecter.c"
+
+/*----------------------------------------------------------------------------*/
+/* Typedefs and macros                                                        */
+/*----------------------------------------------------------------------------*/
+
+#define RELOADS 2000
+#define EJECTS 3                    /* Ejects left in flight by each instance */
+#define EJECT_MS 20                 /* How long the fake drive takes to refuse an eject */
+#define DRAIN_US (10 * G_USEC_PER_SEC)
+
+typedef struct {
+    GObject parent;
+} FakeDrive;
+
+typedef struct {
+    GObjectClass parent_class;
+} FakeDriveClass;
+
+/*----------------------------------------------------------------------------*/
+/* Global data                                                                */
+/*----------------------------------------------------------------------------*/
+
+static int ejects_pending;
+
+/*----------------------------------------------------------------------------*/
+/* Prototypes                                                                 */
+/*----------------------------------------------------------------------------*/
+
+static void fake_drive_iface_init (GDriveIface *iface);
+static gboolean fake_drive_refuse (gpointer data);
+static gboolean drained (void);
+
+G_DEFINE_TYPE_WITH_CODE (FakeDrive, fake_drive, G_TYPE_OBJECT, G_IMPLEMENT_INTERFACE (G_TYPE_DRIVE, fake_drive_iface_init))
+
+/*----------------------------------------------------------------------------*/
+/* Function definitions                                                       */
+/*----------------------------------------------------------------------------*/
+
+/* Panel stand-ins */
+
+int stub_notify (const char *)
+{
+    return 0;
+}
+
+void stub_set_icon (GtkWidget *image)
+{
+    GdkPixbuf *pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB, TRUE, 8, 24, 24);
+
+    /* a real pixbuf, so the activity overlay gets drawn */
+    gdk_pixbuf_fill (pixbuf, 0x808080ff);
+    gtk_image_set_from_pixbuf (GTK_IMAGE (image), pixbuf);
+    g_object_unref (pixbuf);
+}
+
+void stub_drop (GtkWidget *widget)
+{
+    g_object_ref_sink (widget);
+    g_object_unref (widget);
+}
+
+/* A drive which takes a while to refuse every eject and pays no attention
+ * to cancellation, like a stuck one */
+
+static char *fake_drive_get_name (GDrive *)
+{
+    return g_strdup ("Fake drive");
+}
+
+static GList *fake_drive_get_volumes (GDrive *)
+{
+    return NULL;
+}
+
+static gboolean fake_drive_is_media_removable (GDrive *)
+{
+    return TRUE;
+}
+
+static void fake_drive_eject (GDrive *drv, GMountUnmountFlags, GMountOperation *, GCancellable *, GAsyncReadyCallback cb, gpointer data)
+{
+    ejects_pending++;
+    g_timeout_add (EJECT_MS, fake_drive_refuse, g_task_new (drv, NULL, cb, data));
+}
+
+static gboolean fake_drive_refuse (gpointer data)
+{
+    GTask *task = G_TASK (data);
+
+    g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_BUSY, "Fake drive is busy");
+    g_object_unref (task);
+    ejects_pending--;
+    return FALSE;
+}
+
+static gboolean fake_drive_eject_finish (GDrive *, GAsyncResult *res, GError **err)
+{
+    return g_task_propagate_boolean (G_TASK (res), err);
+}
+
+static void fake_drive_iface_init (GDriveIface *iface)
+{
+    iface->get_name = fake_drive_get_name;
+    iface->get_volumes = fake_drive_get_volumes;
+    iface->is_media_removable = fake_drive_is_media_removable;
+    iface->eject_with_operation = fake_drive_eject;
+    iface->eject_with_operation_finish = fake_drive_eject_finish;
+}
+
+static void fake_drive_init (FakeDrive *)
+{
+}
+
+static void fake_drive_class_init (FakeDriveClass *)
+{
+}
+
+/* Everything the plugins started has finished, and nothing they allocated is left */
+
+static gboolean drained (void)
+{
+    int i;
+
+    if (ejects_pending) return FALSE;
+    for (i = 0; i < MEM_TAGS; i++)
+        if (mem_counts[i].live) return FALSE;
+    return TRUE;
+}
+
+int main (int argc, char *argv[])
+{
+    GApplication *app;
+    GDrive *drv;
+    gint64 start, elapsed, total = 0, worst = 0, deadline;
+    char *tmp, *path;
+    int i, j, reloads = argc > 1 ? atoi (argv[1]) : RELOADS, res = 0;
+
+    /* keep the journal, profiles and logind out of the real session */
+    tmp = g_dir_make_tmp ("ejecter-reload-XXXXXX", NULL);
+    g_setenv ("XDG_RUNTIME_DIR", tmp, TRUE);
+    g_setenv ("XDG_CONFIG_HOME", tmp, TRUE);
+    path = g_strdup_printf ("unix:path=%s/logind", tmp);
+    g_setenv ("EJECTER_LOGIND_BUS", path, TRUE);
+    g_free (path);
+    g_setenv ("GIO_USE_VOLUME_MONITOR", "unix", TRUE);
+
+    if (!gtk_init_check (&argc, &argv))
+    {
+        g_print ("No display - skipping\n");
+        g_rmdir (tmp);
+        g_free (tmp);
+        return 77;
+    }
+
+    app = g_application_new ("com.raspberrypi.ejecter-reload", G_APPLICATION_NON_UNIQUE);
+    g_application_set_default (app);
+    drv = g_object_new (fake_drive_get_type (), NULL);
+
+    for (i = 0; i < reloads; i++)
+    {
+        EjecterPlugin *ej = g_new0 (EjecterPlugin, 1);
+        GtkWidget *button = g_object_ref_sink (gtk_button_new ());
+
+        ej->plugin = button;
+        ej->autohide = i & 1;
+        ej->prefetch = TRUE;
+        ej->max_eject = 10;
+
+        start = g_get_monotonic_time ();
+        ejecter_init (ej);
+        elapsed = g_get_monotonic_time () - start;
+
+        for (j = 0; j < EJECTS; j++) eject_drive (ej, drv, VERB_EJECT);
+
+        /* now and then let earlier instances' ejects finish while this one is live */
+        if (i % 8 == 0)
+            while (g_main_context_iteration (NULL, FALSE));
+
+        start = g_get_monotonic_time ();
+        ejecter_destructor (ej);
+        elapsed += g_get_monotonic_time () - start;
+
+        total += elapsed;
+        if (elapsed > worst) worst = elapsed;
+        gtk_widget_destroy (button);
+        g_object_unref (button);
+    }
+
+    /* wait for the last of the ejects to come back to plugins that have gone */
+    deadline = g_get_monotonic_time () + DRAIN_US;
+    while (!drained () && g_get_monotonic_time () < deadline)
+        if (!g_main_context_iteration (NULL, FALSE)) g_usleep (1000);
+    while (g_main_context_iteration (NULL, FALSE));
+
+    g_print ("%d reloads with %d ejects in flight: mean %" G_GINT64_FORMAT " us, worst %" G_GINT64_FORMAT " us\n",
+        reloads, EJECTS, reloads ? total / reloads : 0, worst);
+
+    if (ejects_pending)
+    {
+        g_printerr ("%d ejects never completed\n", ejects_pending);
+        res = 1;
+    }
+    for (i = 0; i < MEM_TAGS; i++)
+    {
+        if (!mem_counts[i].live) continue;
+        g_printerr ("%s: %" G_GSIZE_FORMAT " bytes still allocated after %u allocations and %u frees\n", mem_tags[i], mem_counts[i].live, mem_counts[i].allocs, mem_counts[i].frees);
+        res = 1;
+    }
+
+    g_object_unref (drv);
+    g_object_unref (app);
+
+    path = g_build_filename (tmp, JOURNAL_FILE, NULL);
+    g_remove (path);
+    g_free (path);
+    g_rmdir (tmp);
+    g_free (tmp);
+    return res;
+}
+
+/* End of file */
+/*----------------------------------------------------------------------------*/